@@ -9,9 +9,12 @@
 #include <climits>
 #include <cstdarg>
 #include <cstring>
-#include <forward_list>
+#include <exception>
+#include <functional>
 #include <queue>
 #include <sstream>
+#include <thread>
+#include <type_traits>
 
 //
 // helpers
@@ -343,71 +346,568 @@ static llm_arch llm_arch_from_string(const std::string &name) {
 	return LLM_ARCH_UNKNOWN;
 }
 
-struct naive_trie {
-	naive_trie() : has_value(false), value(0) {}
+//
+// impl
+//
 
-	void insert(const char *key, size_t len, int32_t value = 0) {
-		if (len == 0) {
-			this->has_value = true;
-			this->value		= value;
-			return;
+// FNV-1a, a pair key is hashed as if it was "left right"
+static uint64_t llama_token_map_hash(
+	std::string_view left, std::string_view right, bool is_pair
+) {
+	uint64_t hash = 14695981039346656037ull;
+	for (char c : left) {
+		hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+	}
+	if (is_pair) {
+		hash = (hash ^ (uint8_t)' ') * 1099511628211ull;
+		for (char c : right) {
+			hash = (hash ^ (uint8_t)c) * 1099511628211ull;
 		}
-		char c	 = key[0];
-		auto res = children.find(c);
-		if (res != children.end()) {
-			res->second.insert(key + 1, len - 1, value);
-		} else {
-			auto res = children.insert(std::make_pair(c, naive_trie()));
-			res.first->second.insert(key + 1, len - 1, value);
+	}
+	return hash;
+}
+
+int64_t llama_token_map::lookup(
+	uint64_t hash, std::string_view left, std::string_view right, bool is_pair
+) const {
+	if (slots.empty()) {
+		return -1;
+	}
+	const size_t mask = slots.size() - 1;
+	const size_t len  = left.size() + right.size();
+	for (size_t i = hash & mask;; i = (i + 1) & mask) {
+		const slot &sl = slots[i];
+		if (sl.value < 0) {
+			return -(int64_t)i - 2; // free slot for an insertion
+		}
+		if (sl.hash != hash || sl.len != len ||
+			sl.split != (is_pair ? left.size() : len)) {
+			continue;
+		}
+		const char *key = arena.data() + sl.offset;
+		if (memcmp(key, left.data(), left.size()) == 0 &&
+			memcmp(key + left.size(), right.data(), right.size()) == 0) {
+			return i;
 		}
 	}
+}
 
-	std::pair<const char *, size_t> get_longest_prefix(
-		const char *key, size_t len, size_t offset = 0
-	) {
-		if (len == 0 || offset == len) {
-			return std::make_pair(key, offset);
+void llama_token_map::reserve(size_t n) {
+	// keep the load factor at or below 1/2
+	size_t n_slots = 16;
+	while (n_slots < 2 * n) {
+		n_slots *= 2;
+	}
+	if (n_slots <= slots.size()) {
+		return;
+	}
+	std::vector<slot> old(n_slots);
+	old.swap(slots);
+	const size_t mask = slots.size() - 1;
+	for (const slot &sl : old) {
+		if (sl.value < 0) {
+			continue;
+		}
+		size_t i = sl.hash & mask;
+		while (slots[i].value >= 0) {
+			i = (i + 1) & mask;
+		}
+		slots[i] = sl;
+	}
+}
+
+void llama_token_map::insert(
+	std::string_view left, std::string_view right, bool is_pair, int32_t value
+) {
+	assert(value >= 0);
+	reserve(n_keys + 1);
+	const uint64_t hash = llama_token_map_hash(left, right, is_pair);
+	const int64_t i		= lookup(hash, left, right, is_pair);
+	if (i >= 0) {
+		slots[i].value = value;
+		return;
+	}
+	slot &sl  = slots[-(i + 2)];
+	sl.hash	  = hash;
+	sl.offset = arena.size();
+	sl.len	  = left.size() + right.size();
+	sl.split  = left.size();
+	sl.value  = value;
+	arena.insert(arena.end(), left.begin(), left.end());
+	arena.insert(arena.end(), right.begin(), right.end());
+	n_keys++;
+}
+
+void llama_token_map::insert(std::string_view key, int32_t value) {
+	insert(key, std::string_view(), false, value);
+}
+
+void llama_token_map::insert(
+	std::string_view left, std::string_view right, int32_t value
+) {
+	insert(left, right, true, value);
+}
+
+int32_t llama_token_map::find(std::string_view key) const {
+	const int64_t i = lookup(
+		llama_token_map_hash(key, std::string_view(), false), key,
+		std::string_view(), false
+	);
+	return i >= 0 ? slots[i].value : -1;
+}
+
+int32_t llama_token_map::find(
+	std::string_view left, std::string_view right
+) const {
+	const int64_t i =
+		lookup(llama_token_map_hash(left, right, true), left, right, true);
+	return i >= 0 ? slots[i].value : -1;
+}
+
+int32_t llama_token_map::at(std::string_view key) const {
+	const int32_t value = find(key);
+	if (value < 0) {
+		throw std::out_of_range(
+			"llama_token_map::at: unknown token '" + std::string(key) + "'"
+		);
+	}
+	return value;
+}
+
+void llama_token_trie::build(
+	const std::vector<std::pair<std::string_view, int32_t>> &keys
+) {
+	std::vector<uint32_t> order(keys.size());
+	for (uint32_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	// stable, so that among duplicate keys the last one is visited last
+	std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+		return keys[a].first < keys[b].first;
+	});
+
+	units.assign(1, unit());
+
+	// free units form a circular doubly linked list, unit 0 (the root, which
+	// is never free) doubles as its head
+	std::vector<int32_t> next_free(1, 0);
+	std::vector<int32_t> prev_free(1, 0);
+
+	auto grow = [&](size_t size) {
+		for (int32_t i = units.size(); (size_t)i < size; ++i) {
+			units.emplace_back();
+			next_free.push_back(0);
+			prev_free.push_back(prev_free[0]);
+			next_free[prev_free[0]] = i;
+			prev_free[0]			= i;
+		}
+	};
+
+	auto occupy = [&](int32_t i, int32_t parent) {
+		next_free[prev_free[i]] = next_free[i];
+		prev_free[next_free[i]] = prev_free[i];
+		units[i].check			= parent;
+	};
+
+	// first base >= 1 for which all the children land on free units
+	auto find_base = [&](const std::vector<uint8_t> &labels) -> int32_t {
+		for (int32_t pos = next_free[0]; pos != 0; pos = next_free[pos]) {
+			const int32_t base = pos - labels[0];
+			if (base < 1) {
+				continue;
+			}
+			bool fits = true;
+			for (size_t k = 1; k < labels.size() && fits; ++k) {
+				const size_t t = base + labels[k];
+				fits		   = t >= units.size() || units[t].check < 0;
+			}
+			if (fits) {
+				return base;
+			}
 		}
-		char c	 = key[offset];
-		auto res = children.find(c);
-		if (res != children.end()) {
-			return res->second.get_longest_prefix(key, len, offset + 1);
+		return std::max<int32_t>(1, units.size() - labels[0]);
+	};
+
+	struct range {
+		uint32_t begin;
+		uint32_t end;
+		uint32_t depth;
+		int32_t node;
+	};
+	std::vector<range> stack;
+	if (!order.empty()) {
+		stack.push_back({0, (uint32_t)order.size(), 0, root});
+	}
+
+	std::vector<uint8_t> labels;
+	std::vector<uint32_t> starts;
+	while (!stack.empty()) {
+		const range r = stack.back();
+		stack.pop_back();
+
+		// the keys in [begin, end) share their first depth bytes, the ones
+		// that end here sort first
+		uint32_t i = r.begin;
+		for (; i < r.end && keys[order[i]].first.size() == r.depth; ++i) {
+			units[r.node].value = keys[order[i]].second;
 		}
+		if (i == r.end) {
+			continue;
+		}
+
+		labels.clear();
+		starts.clear();
+		for (; i < r.end; ++i) {
+			const uint8_t c = keys[order[i]].first[r.depth];
+			if (labels.empty() || labels.back() != c) {
+				labels.push_back(c);
+				starts.push_back(i);
+			}
+		}
+		starts.push_back(r.end);
+
+		const int32_t base = find_base(labels);
+		grow(base + labels.back() + 1);
+		units[r.node].base = base;
+		for (size_t k = 0; k < labels.size(); ++k) {
+			occupy(base + labels[k], r.node);
+			stack.push_back(
+				{starts[k], starts[k + 1], r.depth + 1, base + labels[k]}
+			);
+		}
+	}
 
-		return std::make_pair(key, offset);
+	units.shrink_to_fit();
+}
+
+int32_t llama_token_trie::find(std::string_view key) const {
+	int32_t node = root;
+	for (char c : key) {
+		node = child(node, c);
+		if (node < 0) {
+			return -1;
+		}
 	}
+	return value(node);
+}
 
-	const struct naive_trie *traverse(const char c) const {
-		auto res = children.find(c);
-		if (res != children.end()) {
-			return &res->second;
+std::pair<size_t, int32_t> llama_token_trie::longest_prefix(
+	std::string_view text
+) const {
+	std::pair<size_t, int32_t> longest(0, -1);
+	int32_t node = root;
+	for (size_t i = 0; i < text.size(); ++i) {
+		node = child(node, text[i]);
+		if (node < 0) {
+			break;
+		}
+		if (value(node) >= 0) {
+			longest = {i + 1, value(node)};
 		}
+	}
+	return longest;
+}
 
-		return NULL;
+bool llama_bpe_word_cache::get(
+	const std::string &word, std::vector<llama_token> &output
+) {
+	shard &sh = shard_of(word);
+	std::lock_guard<std::mutex> lock(sh.mutex);
+	auto it = sh.index.find(word);
+	if (it == sh.index.end()) {
+		return false;
 	}
-	std::map<char, struct naive_trie> children;
-	bool has_value;
-	llama_token value;
-};
+	sh.entries.splice(sh.entries.begin(), sh.entries, it->second);
+	const auto &ids = it->second->second;
+	output.insert(output.end(), ids.begin(), ids.end());
+	return true;
+}
 
-//
-// impl
-//
+void llama_bpe_word_cache::put(
+	const std::string &word, std::vector<llama_token> ids
+) {
+	const size_t shard_capacity = (capacity + n_shards - 1) / n_shards;
+	if (shard_capacity == 0) {
+		return;
+	}
+	shard &sh = shard_of(word);
+	std::lock_guard<std::mutex> lock(sh.mutex);
+	if (sh.index.find(word) != sh.index.end()) {
+		return;
+	}
+	if (sh.entries.size() >= shard_capacity) {
+		sh.index.erase(sh.entries.back().first);
+		sh.entries.pop_back();
+	}
+	sh.entries.emplace_front(word, std::move(ids));
+	sh.index.emplace(sh.entries.front().first, sh.entries.begin());
+}
 
 int llama_vocab::find_bpe_rank(
-	const std::string &token_left, const std::string &token_right
+	std::string_view token_left, std::string_view token_right
 ) const {
 	assert(token_left.find(' ') == std::string::npos);
 	assert(token_left.find('\n') == std::string::npos);
 	assert(token_right.find(' ') == std::string::npos);
 	assert(token_right.find('\n') == std::string::npos);
 
-	auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-	if (it == bpe_ranks.end()) {
-		return -1;
+	return bpe_ranks.find(token_left, token_right);
+}
+
+void llama_special_token_matcher::build(
+	const std::vector<std::string_view> &patterns
+) {
+	// bytes that do not start or continue any pattern all behave the same
+	std::fill(std::begin(byte_class), std::end(byte_class), 0);
+	n_classes = 1;
+	for (const auto &p : patterns) {
+		for (char c : p) {
+			if (byte_class[(uint8_t)c] == 0) {
+				byte_class[(uint8_t)c] = n_classes++;
+			}
+		}
+	}
+
+	// trie of the patterns, -1 for a missing edge
+	next.assign(n_classes, -1);
+	out.assign(1, -1);
+	lengths.clear();
+	for (uint32_t i = 0; i < patterns.size(); ++i) {
+		int32_t state = 0;
+		for (char c : patterns[i]) {
+			const size_t edge = (size_t)state * n_classes + byte_class[(uint8_t)c];
+			if (next[edge] < 0) {
+				next[edge] = out.size();
+				next.resize(next.size() + n_classes, -1);
+				out.push_back(-1);
+			}
+			state = next[edge];
+		}
+		out[state] = i;
+		lengths.push_back(patterns[i].size());
+	}
+
+	// breadth-first, so the failure state of a state is always complete
+	// when its missing edges are filled in from it
+	const size_t n_states = out.size();
+	std::vector<int32_t> fail(n_states, 0);
+	dict.assign(n_states, -1);
+	std::vector<int32_t> queue;
+	queue.reserve(n_states);
+	for (uint32_t c = 0; c < n_classes; ++c) {
+		int32_t &child = next[c];
+		if (child < 0) {
+			child = 0;
+		} else {
+			queue.push_back(child);
+		}
+	}
+	for (size_t head = 0; head < queue.size(); ++head) {
+		const int32_t state = queue[head];
+		const int32_t f		= fail[state];
+		for (uint32_t c = 0; c < n_classes; ++c) {
+			int32_t &child = next[(size_t)state * n_classes + c];
+			if (child < 0) {
+				child = next[(size_t)f * n_classes + c];
+				continue;
+			}
+			const int32_t child_fail = next[(size_t)f * n_classes + c];
+			fail[child]				 = child_fail;
+			dict[child] = out[child_fail] >= 0 ? child_fail : dict[child_fail];
+			queue.push_back(child);
+		}
+	}
+}
+
+void llama_special_token_matcher::find_all(
+	std::string_view text, std::vector<match> &matches
+) const {
+	if (empty()) {
+		return;
+	}
+	int32_t state = 0;
+	for (size_t i = 0; i < text.size(); ++i) {
+		state =
+			next[(size_t)state * n_classes + byte_class[(uint8_t)text[i]]];
+		for (int32_t s = out[state] >= 0 ? state : dict[state]; s >= 0;
+			 s		   = dict[s]) {
+			const uint32_t pattern = out[s];
+			matches.push_back({pattern, (uint32_t)(i + 1 - lengths[pattern])});
+		}
+	}
+}
+
+//
+// snapshot serialization
+//
+
+// PODs and arrays of PODs are stored with their in-memory representation
+struct llama_vocab_writer {
+	std::vector<char> &out;
+
+	void bytes(const void *data, size_t size) {
+		out.insert(out.end(), (const char *)data, (const char *)data + size);
+	}
+	template <typename T> void pod(const T &value) {
+		bytes(&value, sizeof(T));
+	}
+	template <typename T> void array(const T *data, size_t n) {
+		pod<uint64_t>(n);
+		bytes(data, n * sizeof(T));
+	}
+	template <typename T> void array(const std::vector<T> &values) {
+		array(values.data(), values.size());
+	}
+};
+
+// a truncated input sets ok to false and reads zeros from then on
+struct llama_vocab_reader {
+	const char *cur;
+	const char *end;
+	bool ok = true;
+
+	const char *bytes(size_t size) {
+		if (!ok || (size_t)(end - cur) < size) {
+			ok = false;
+			return nullptr;
+		}
+		const char *data = cur;
+		cur += size;
+		return data;
+	}
+	template <typename T> T pod() {
+		T value{};
+		if (const char *data = bytes(sizeof(T))) {
+			memcpy(&value, data, sizeof(T));
+		}
+		return value;
+	}
+	// returns the array in place, n is 0 on error
+	template <typename T> const char *array(size_t &n) {
+		n = pod<uint64_t>();
+		if (!ok || n > (size_t)(end - cur) / sizeof(T)) {
+			ok = false;
+			n  = 0;
+			return nullptr;
+		}
+		return bytes(n * sizeof(T));
+	}
+	template <typename T> void array(std::vector<T> &values) {
+		size_t n;
+		const char *data = array<T>(n);
+		values.resize(n);
+		if (n > 0) {
+			memcpy(values.data(), data, n * sizeof(T));
+		}
+	}
+};
+
+void llama_token_map::save(llama_vocab_writer &writer) const {
+	writer.array(arena);
+	writer.array(slots);
+	writer.pod<uint64_t>(n_keys);
+}
+
+void llama_token_map::load(llama_vocab_reader &reader, int32_t value_end) {
+	reader.array(arena);
+	reader.array(slots);
+	n_keys = reader.pod<uint64_t>();
+
+	// a lookup probes until it meets a free slot and compares the key bytes
+	// of every slot it passes, so there has to be a free slot and every key
+	// has to lie in the arena
+	size_t n_used = 0;
+	for (const slot &sl : slots) {
+		if (sl.value < 0) {
+			if (sl.value != -1) {
+				reader.ok = false;
+			}
+			continue;
+		}
+		if (sl.value >= value_end || sl.split > sl.len ||
+			(uint64_t)sl.offset + sl.len > arena.size()) {
+			reader.ok = false;
+		}
+		n_used++;
+	}
+	if ((slots.size() & (slots.size() - 1)) != 0 || n_used != n_keys ||
+		(!slots.empty() && n_used == slots.size())) {
+		reader.ok = false;
 	}
+}
 
-	return it->second;
+void llama_token_trie::save(llama_vocab_writer &writer) const {
+	writer.array(units);
+}
+
+void llama_token_trie::load(llama_vocab_reader &reader, int32_t value_end) {
+	reader.array(units);
+	if (units.empty()) {
+		units.resize(1);
+	}
+
+	// child() computes base + c before it checks the result against the size,
+	// so base must not overflow, and a node must lie in the array
+	for (const unit &u : units) {
+		if (u.base < 0 || (size_t)u.base > units.size() || u.check < -1 ||
+			u.check >= (int64_t)units.size() || u.value < -1 ||
+			u.value >= value_end) {
+			reader.ok = false;
+			return;
+		}
+	}
+}
+
+void llama_special_token_matcher::save(llama_vocab_writer &writer) const {
+	writer.array(byte_class, 256);
+	writer.pod(n_classes);
+	writer.array(next);
+	writer.array(out);
+	writer.array(dict);
+	writer.array(lengths);
+}
+
+void llama_special_token_matcher::load(
+	llama_vocab_reader &reader, const std::vector<std::string_view> &patterns
+) {
+	size_t n;
+	const char *classes = reader.array<uint16_t>(n);
+	if (n == 256) {
+		memcpy(byte_class, classes, sizeof(byte_class));
+	} else {
+		reader.ok = false;
+	}
+	n_classes = reader.pod<uint32_t>();
+	reader.array(next);
+	reader.array(out);
+	reader.array(dict);
+	reader.array(lengths);
+	if (!reader.ok || lengths.empty()) {
+		return;
+	}
+
+	// find_all() follows the transitions and dictionary links without any
+	// checks and takes the start of a match from the length of its pattern
+	const size_t n_states = out.size();
+	bool ok = n_classes >= 1 && n_classes <= 257 &&
+			  lengths.size() == patterns.size() && dict.size() == n_states &&
+			  next.size() == n_states * n_classes;
+	for (size_t i = 0; ok && i < 256; ++i) {
+		ok = byte_class[i] < n_classes;
+	}
+	for (size_t i = 0; ok && i < next.size(); ++i) {
+		ok = next[i] >= 0 && (size_t)next[i] < n_states;
+	}
+	for (size_t i = 0; ok && i < n_states; ++i) {
+		ok = out[i] >= -1 && out[i] < (int64_t)lengths.size() &&
+			 dict[i] >= -1 && dict[i] < (int64_t)n_states;
+	}
+	for (size_t i = 0; ok && i < lengths.size(); ++i) {
+		ok = lengths[i] == patterns[i].size();
+	}
+	if (!ok) {
+		reader.ok = false;
+	}
 }
 
 static enum llama_vocab_type llama_vocab_get_type(const llama_vocab &vocab) {
@@ -577,12 +1077,12 @@ struct llm_tokenizer_spm {
 
 private:
 	void resegment(llm_symbol &symbol, std::vector<llama_vocab::id> &output) {
-		auto text  = std::string(symbol.text, symbol.n);
-		auto token = vocab.token_to_id.find(text);
+		const std::string_view text(symbol.text, symbol.n);
+		const auto token = vocab.token_trie.find(text);
 
 		// Do we need to support is_unused?
-		if (token != vocab.token_to_id.end()) {
-			output.push_back((*token).second);
+		if (token >= 0) {
+			output.push_back(token);
 			return;
 		}
 
@@ -608,19 +1108,21 @@ private:
 			return;
 		}
 
-		const std::string text =
-			std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-		auto token = vocab.token_to_id.find(text);
+		// the symbols are adjacent in the input, so the pair is a single span
+		const std::string_view text(
+			symbols[left].text, symbols[left].n + symbols[right].n
+		);
+		const auto token = vocab.token_trie.find(text);
 
-		if (token == vocab.token_to_id.end()) {
+		if (token < 0) {
 			return;
 		}
 
-		if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+		if (static_cast<size_t>(token) >= vocab.id_to_token.size()) {
 			return;
 		}
 
-		const auto &tok_data = vocab.id_to_token[(*token).second];
+		const auto &tok_data = vocab.id_to_token[token];
 
 		llm_bigram_spm bigram;
 		bigram.left	 = left;
@@ -639,7 +1141,7 @@ private:
 	std::vector<llm_symbol> symbols;
 	llm_bigram_spm::queue work_queue;
 
-	std::map<std::string, std::pair<int, int>> rev_merge;
+	std::map<std::string_view, std::pair<int, int>> rev_merge;
 };
 
 //
@@ -681,7 +1183,6 @@ struct llm_bigram_bpe {
 		llama_priority_queue<llm_bigram_bpe, queue_storage, comparator>;
 	llm_symbol::index left;
 	llm_symbol::index right;
-	std::string text;
 	int rank;
 	size_t size;
 };
@@ -869,132 +1370,134 @@ struct llm_tokenizer_bpe {
 	void tokenize(
 		const std::string &text, std::vector<llama_vocab::id> &output
 	) {
-		int final_prev_index = -1;
+		const auto word_collection = split(text);
+		tokenize(word_collection, 0, word_collection.size(), output);
+	}
 
-		const auto word_collection = unicode_regex_split(text, regex_exprs);
+	// pre-tokenize text into the words the merges run on
+	std::vector<std::string> split(const std::string &text) const {
+		return unicode_regex_split(text, regex_exprs);
+	}
 
-		symbols_final.clear();
+	// tokenize words [begin, end), the words are independent of each other
+	void tokenize(
+		const std::vector<std::string> &words, size_t begin, size_t end,
+		std::vector<llama_vocab::id> &output
+	) {
+		for (size_t i = begin; i < end; ++i) {
+			const auto &word = words[i];
+			// the merges only ever see one word, so repeated words can reuse
+			// the ids computed last time
+			if (vocab.bpe_cache.get(word, output)) {
+				continue;
+			}
+			const size_t n_output = output.size();
+			tokenize_word(word, output);
+			vocab.bpe_cache.put(
+				word, std::vector<llama_vocab::id>(
+						  output.begin() + n_output, output.end()
+					  )
+			);
+		}
+	}
 
-		for (auto &word : word_collection) {
-			work_queue = llm_bigram_bpe::queue();
-			symbols.clear();
+private:
+	void tokenize_word(
+		const std::string &word, std::vector<llama_vocab::id> &output
+	) {
+		work_queue = llm_bigram_bpe::queue();
+		symbols.clear();
 
-			int index	  = 0;
-			size_t offset = 0;
+		int index	  = 0;
+		size_t offset = 0;
 
-			if (vocab.tokenizer_ignore_merges &&
-				vocab.token_to_id.find(word) != vocab.token_to_id.end()) {
-				symbols.emplace_back(
-					llm_symbol{-1, -1, word.c_str(), word.size()}
-				);
-				offset = word.size();
-			}
-
-			while (offset < word.size()) {
-				llm_symbol sym;
-				size_t char_len = std::min(
-					word.size() - offset, (size_t)unicode_len_utf8(word[offset])
-				);
-				sym.text = word.c_str() + offset;
-				sym.n	 = char_len;
-				offset += sym.n;
-				sym.prev = index - 1;
-				sym.next = offset == word.size() ? -1 : index + 1;
-				index++;
-				symbols.emplace_back(sym);
-			}
-			for (size_t i = 1; i < symbols.size(); ++i) {
-				add_new_bigram(i - 1, i);
-			}
+		if (vocab.tokenizer_ignore_merges &&
+			vocab.token_to_id.find(word) >= 0) {
+			symbols.emplace_back(llm_symbol{-1, -1, word.c_str(), word.size()});
+			offset = word.size();
+		}
 
-			// build token(s)
-			while (!work_queue.empty()) {
-				auto bigram = work_queue.pop_move();
+		while (offset < word.size()) {
+			llm_symbol sym;
+			size_t char_len = std::min(
+				word.size() - offset, (size_t)unicode_len_utf8(word[offset])
+			);
+			sym.text = word.c_str() + offset;
+			sym.n	 = char_len;
+			offset += sym.n;
+			sym.prev = index - 1;
+			sym.next = offset == word.size() ? -1 : index + 1;
+			index++;
+			symbols.emplace_back(sym);
+		}
+		for (size_t i = 1; i < symbols.size(); ++i) {
+			add_new_bigram(i - 1, i);
+		}
 
-				auto &left_symbol  = symbols[bigram.left];
-				auto &right_symbol = symbols[bigram.right];
+		// build token(s)
+		while (!work_queue.empty()) {
+			auto bigram = work_queue.pop_move();
 
-				if (left_symbol.n == 0 || right_symbol.n == 0) {
-					continue;
-				}
-				std::string left_token =
-					std::string(left_symbol.text, left_symbol.n);
-				std::string right_token =
-					std::string(right_symbol.text, right_symbol.n);
-				if (left_token + right_token != bigram.text) {
-					continue; // Skip this bigram if it's outdated
-				}
+			auto &left_symbol  = symbols[bigram.left];
+			auto &right_symbol = symbols[bigram.right];
 
-				// merge the right sym into the left one
-				left_symbol.n += right_symbol.n;
-				right_symbol.n = 0;
+			if (left_symbol.n == 0 || right_symbol.n == 0) {
+				continue;
+			}
+			// symbols only grow by merging, so the bigram is outdated iff
+			// either side has grown since it was queued
+			if (left_symbol.n + right_symbol.n != bigram.size) {
+				continue;
+			}
 
-				// remove the right sym from the chain
-				left_symbol.next = right_symbol.next;
-				if (right_symbol.next >= 0) {
-					symbols[right_symbol.next].prev = bigram.left;
-				}
+			// merge the right sym into the left one
+			left_symbol.n += right_symbol.n;
+			right_symbol.n = 0;
 
-				add_new_bigram(
-					left_symbol.prev, bigram.left
-				); // left side of current symbol
-				add_new_bigram(
-					bigram.left, left_symbol.next
-				); // right side of current symbol
-			}
-
-			// add the finished tokens to the final list keeping correct order for next and prev
-			for (auto &sym : symbols) {
-				if (sym.n > 0) {
-					sym.prev = final_prev_index;
-					sym.next = -1;
-					if (final_prev_index != -1) {
-						symbols_final[final_prev_index].next =
-							symbols_final.size();
-					}
-					symbols_final.emplace_back(sym);
-					final_prev_index = symbols_final.size() - 1;
-				}
+			// remove the right sym from the chain
+			left_symbol.next = right_symbol.next;
+			if (right_symbol.next >= 0) {
+				symbols[right_symbol.next].prev = bigram.left;
 			}
-		}
 
-		symbols = symbols_final;
+			add_new_bigram(
+				left_symbol.prev, bigram.left
+			); // left side of current symbol
+			add_new_bigram(
+				bigram.left, left_symbol.next
+			); // right side of current symbol
+		}
 
-		if (!symbols.empty()) {
-			for (int i = 0; i != -1; i = symbols[i].next) {
-				auto &symbol = symbols[i];
-				if (symbol.n == 0) {
-					continue;
-				}
+		// the surviving symbols are in text order
+		for (const auto &symbol : symbols) {
+			if (symbol.n == 0) {
+				continue;
+			}
 
-				const std::string str = std::string(symbol.text, symbol.n);
-				const auto token	  = vocab.token_to_id.find(str);
+			const std::string_view str(symbol.text, symbol.n);
+			const auto token = vocab.token_to_id.find(str);
 
-				if (token == vocab.token_to_id.end()) {
-					for (auto j = str.begin(); j != str.end(); ++j) {
-						std::string byte_str(1, *j);
-						auto token_multibyte = vocab.token_to_id.find(byte_str);
-						if (token_multibyte != vocab.token_to_id.end()) {
-							output.push_back(token_multibyte->second);
-						}
+			if (token < 0) {
+				for (char c : str) {
+					auto token_multibyte =
+						vocab.token_to_id.find(std::string_view(&c, 1));
+					if (token_multibyte >= 0) {
+						output.push_back(token_multibyte);
 					}
-				} else {
-					output.push_back((*token).second);
 				}
+			} else {
+				output.push_back(token);
 			}
 		}
 	}
 
-private:
 	void add_new_bigram(int left, int right) {
 		if (left == -1 || right == -1) {
 			return;
 		}
 
-		std::string left_token =
-			std::string(symbols[left].text, symbols[left].n);
-		std::string right_token =
-			std::string(symbols[right].text, symbols[right].n);
+		std::string_view left_token(symbols[left].text, symbols[left].n);
+		std::string_view right_token(symbols[right].text, symbols[right].n);
 
 		int rank_found = -1;
 
@@ -1008,7 +1511,6 @@ private:
 
 		bigram.left	 = left;
 		bigram.right = right;
-		bigram.text	 = left_token + right_token;
 		bigram.size	 = left_token.size() + right_token.size();
 		bigram.rank	 = rank_found;
 
@@ -1020,7 +1522,6 @@ private:
 	std::vector<std::string> regex_exprs;
 
 	std::vector<llm_symbol> symbols;
-	std::vector<llm_symbol> symbols_final;
 
 	llm_bigram_bpe::queue work_queue;
 };
@@ -1034,8 +1535,6 @@ struct llm_tokenizer_wpm {
 
 	void tokenize(const std::string &text, std::vector<llama_vocab::id> &output)
 		const {
-		const auto &token_map = vocab.token_to_id;
-
 		// normalize and split by whitespace
 		std::vector<std::string> words = preprocess(text);
 
@@ -1056,24 +1555,17 @@ struct llm_tokenizer_wpm {
 
 			// we're at the start of a new word
 			// move through character position in word
-			for (int i = 0; i < n; ++i) {
-				// loop through possible match length
-				bool match = false;
-				for (int j = std::min(n, i + vocab.max_token_len + 1); j > i;
-					 j--) {
-					auto it = token_map.find(word1.substr(i, j - i));
-					if (it != token_map.end()) {
-						output.push_back(it->second);
-						match = true;
-						i	  = j - 1;
-						break;
-					}
-				}
-
-				if (!match) { // discard all
+			for (int i = 0; i < n;) {
+				// longest token starting at i
+				const auto match = vocab.token_trie.longest_prefix(
+					std::string_view(word1).substr(i)
+				);
+				if (match.first == 0) { // discard all
 					output.resize(current_tokens);
 					break; // and discard next tokens
 				}
+				output.push_back(match.second);
+				i += match.first;
 			}
 
 			// we didn't find any matches for this word
@@ -1146,7 +1638,9 @@ struct llm_tokenizer_wpm {
 //
 
 struct llm_tokenizer_ugm {
-	llm_tokenizer_ugm(const llama_vocab &vocab) : vocab(vocab) {
+	llm_tokenizer_ugm(const llama_vocab &vocab)
+		: vocab(vocab), token_matcher(vocab.token_trie),
+		  user_defined_token_matcher(vocab.user_defined_trie) {
 		if (vocab.precompiled_charsmap.size() > 0) {
 			size_t charsmap_offset = 0;
 
@@ -1183,20 +1677,6 @@ struct llm_tokenizer_ugm {
 				min_score = std::min<float>(min_score, token_data.score);
 				max_score = std::max<float>(max_score, token_data.score);
 			}
-
-			if (llama_is_normal_token(vocab, id) ||
-				llama_is_user_defined_token(vocab, id) ||
-				llama_is_unused_token(vocab, id)) {
-				token_matcher.insert(
-					token_data.text.data(), token_data.text.size(), id
-				);
-			}
-
-			if (llama_is_user_defined_token(vocab, id)) {
-				user_defined_token_matcher.insert(
-					token_data.text.data(), token_data.text.size()
-				);
-			}
 		}
 
 		unknown_token_score = min_score - unknown_token_score_penalty;
@@ -1248,17 +1728,18 @@ struct llm_tokenizer_ugm {
 			bool single_codepoint_token_found = false;
 			const struct best_tokenization &current_best =
 				tokenization_results[input_offset];
-			const struct naive_trie *node =
-				token_matcher.traverse(normalized[prefix_offset++]);
+			int32_t node = token_matcher.child(
+				llama_token_trie::root, normalized[prefix_offset++]
+			);
 
-			while (prefix_offset <= input_len && node != NULL) {
+			while (prefix_offset <= input_len && node >= 0) {
 				// check if we found valid token in prefix
-				if (node->has_value) {
+				if (token_matcher.value(node) >= 0) {
 					// check if it corresponds to the whole UTF code point
 					if (prefix_offset - input_offset == n_utf8_code_units) {
 						single_codepoint_token_found = true;
 					}
-					llama_token token_id   = node->value;
+					llama_token token_id   = token_matcher.value(node);
 					const auto &token_data = vocab.id_to_token[token_id];
 
 					// we set the user-defined token scores to 0 to make them more likely to be selected
@@ -1280,7 +1761,7 @@ struct llm_tokenizer_ugm {
 						current_champ = challenger;
 					}
 				}
-				node = node->traverse(normalized[prefix_offset++]);
+				node = token_matcher.child(node, normalized[prefix_offset++]);
 			}
 
 			// if we didn't find a valid token corresponding to the whole UTF code point
@@ -1444,15 +1925,24 @@ private:
 		}
 
 		// if input prefix matches some user-defined token return this token as normalization result
-		auto user_defined_token_match =
-			user_defined_token_matcher.get_longest_prefix(
-				&input[input_offset], input.size() - input_offset
+		// (like the previous trie implementation, this takes the longest path
+		// through the trie, which is not necessarily a whole token)
+		size_t user_defined_token_len = 0;
+		for (int32_t node = llama_token_trie::root;
+			 input_offset + user_defined_token_len < input.size();
+			 ++user_defined_token_len) {
+			node = user_defined_token_matcher.child(
+				node, input[input_offset + user_defined_token_len]
 			);
-		if (user_defined_token_match.second > 0) {
+			if (node < 0) {
+				break;
+			}
+		}
+		if (user_defined_token_len > 0) {
 			return {
 				&input[input_offset],
-				user_defined_token_match.second,
-				user_defined_token_match.second
+				user_defined_token_len,
+				user_defined_token_len
 			};
 		}
 
@@ -1536,7 +2026,9 @@ private:
 	const uint32_t *xcda_array = NULL;
 	size_t xcda_array_size	   = 0;
 
-	struct naive_trie user_defined_token_matcher;
+	// built by llm_load_vocab, see llama_vocab::token_trie
+	const llama_token_trie &token_matcher;
+	const llama_token_trie &user_defined_token_matcher;
 
 	// this structure stores the best tokenization so far at input_offset
 	struct best_tokenization {
@@ -1550,8 +2042,6 @@ private:
 
 	float unknown_token_score_penalty = 10.0;
 	float unknown_token_score;
-
-	struct naive_trie token_matcher;
 };
 
 //
@@ -1614,17 +2104,9 @@ static std::vector<uint8_t> llama_unescape_rwkv_token(const std::string &escaped
 }
 
 struct llm_tokenizer_rwkv {
-	llm_tokenizer_rwkv(const llama_vocab &vocab) : vocab(vocab) {
-		// RWKV supports arbitrary byte tokens, but the vocab struct only supports string tokens.
-		// For now, we decode the vocab here into the lookup we'll use for tokenization.
-
-		// build trie
-		for (unsigned int id = 0; id < vocab.id_to_token.size(); ++id) {
-			const auto &token = vocab.id_to_token[id];
-			const auto data	  = llama_unescape_rwkv_token(token.text);
-			token_matcher.insert((const char *)data.data(), data.size(), id);
-		}
-	}
+	// the trie over the unescaped token bytes is built by llm_load_vocab
+	llm_tokenizer_rwkv(const llama_vocab &vocab)
+		: vocab(vocab), token_matcher(vocab.token_trie) {}
 
 	void tokenize(
 		const std::string &text, std::vector<llama_vocab::id> &output
@@ -1632,9 +2114,9 @@ struct llm_tokenizer_rwkv {
 		uint32_t position = 0;
 
 		while (position < text.size()) {
-			const struct naive_trie *node =
-				token_matcher.traverse(text[position]);
-			if (node == NULL) {
+			int32_t node =
+				token_matcher.child(llama_token_trie::root, text[position]);
+			if (node < 0) {
 				// no matching token found, add unknown token
 				output.push_back(vocab.special_unk_id);
 				position += 1;
@@ -1644,12 +2126,12 @@ struct llm_tokenizer_rwkv {
 			// traverse the trie to find the longest matching token
 			uint32_t token_id	  = 0;
 			uint32_t token_length = 0;
-			while (node != NULL) {
-				if (node->has_value) {
-					token_id	 = node->value;
+			while (node >= 0) {
+				if (token_matcher.value(node) >= 0) {
+					token_id	 = token_matcher.value(node);
 					token_length = position + 1;
 				}
-				node = node->traverse(text[++position]);
+				node = token_matcher.child(node, text[++position]);
 			}
 
 			// add the longest matching token
@@ -1660,7 +2142,7 @@ struct llm_tokenizer_rwkv {
 
 	const llama_vocab &vocab;
 
-	struct naive_trie token_matcher;
+	const llama_token_trie &token_matcher;
 };
 
 //
@@ -1672,44 +2154,67 @@ typedef enum FRAGMENT_BUFFER_VARIANT_TYPE {
 	FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT
 } FRAGMENT_BUFFER_VARIANT_TYPE;
 
+// a special token, or a range of the raw text that still has to be tokenized
 struct fragment_buffer_variant {
 	fragment_buffer_variant(llama_vocab::id _token) :
 		type(FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN),
 		token(_token),
-		raw_text(_dummy),
 		offset(0),
 		length(0) {}
 
-	fragment_buffer_variant(
-		const std::string &_raw_text, int64_t _offset, int64_t _length
-	) :
+	fragment_buffer_variant(uint64_t _offset, uint64_t _length) :
 		type(FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT),
 		token((llama_vocab::id)-1),
-		raw_text(_raw_text),
 		offset(_offset),
 		length(_length) {
-		assert(_offset >= 0);
 		assert(_length >= 1);
-		assert(offset + length <= raw_text.length());
 	}
 
-	const FRAGMENT_BUFFER_VARIANT_TYPE type;
-	const llama_vocab::id token;
-	const std::string _dummy;
-	const std::string &raw_text;
-	const uint64_t offset;
-	const uint64_t length;
+	FRAGMENT_BUFFER_VARIANT_TYPE type;
+	llama_vocab::id token;
+	uint64_t offset;
+	uint64_t length;
 };
 
 // #define PRETOKENIZERDEBUG
 
+// Splits the raw text fragments at the special tokens. The tokens are applied
+// one after another in the order of cache_special_tokens, each taking its
+// leftmost non-overlapping occurrences in what the previous ones left over.
+// The occurrences of all of them are found up front in a single pass, so only
+// the tokens that occur in the text cost anything.
 static void tokenizer_st_partition(
 	const llama_vocab &vocab,
-	std::forward_list<fragment_buffer_variant> &buffer,
+	const std::string &raw_text,
+	std::vector<fragment_buffer_variant> &buffer,
 	bool parse_special
 ) {
-	// for each special token
-	for (const llama_vocab::id special_id : vocab.cache_special_tokens) {
+	std::vector<llama_special_token_matcher::match> matches;
+	vocab.special_token_matcher.find_all(raw_text, matches);
+	if (matches.empty()) {
+		return;
+	}
+	std::sort(
+		matches.begin(),
+		matches.end(),
+		[](const llama_special_token_matcher::match &a,
+		   const llama_special_token_matcher::match &b) {
+			return a.pattern < b.pattern ||
+				   (a.pattern == b.pattern && a.pos < b.pos);
+		}
+	);
+
+	std::vector<fragment_buffer_variant> result;
+	for (size_t first = 0, last; first < matches.size(); first = last) {
+		// [first, last) are the occurrences of one special token
+		last = first;
+		while (last < matches.size() &&
+			   matches[last].pattern == matches[first].pattern) {
+			last++;
+		}
+
+		const llama_vocab::id special_id =
+			vocab.cache_special_tokens[matches[first].pattern];
 		const auto &data		  = vocab.id_to_token[special_id];
 		const auto &special_token = data.text;
 
@@ -1722,189 +2227,210 @@ static void tokenizer_st_partition(
 			// This is mostly relevant for neox-style tokenizers (mpt, olmo, stablelm, etc.)
 		}
 
-		// for each text fragment
-		std::forward_list<fragment_buffer_variant>::iterator it =
-			buffer.begin();
-		while (it != buffer.end()) {
-			auto &fragment = (*it);
-
+		// the fragments are in text order, so one sweep over the sorted
+		// occurrences finds the first one at or after any search position
+		size_t next_match = first;
+		result.clear();
+		for (const auto &fragment : buffer) {
 			// if a fragment is text ( not yet processed )
-			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto &raw_text = fragment.raw_text;
-
-				auto raw_text_base_offset = fragment.offset;
-				auto raw_text_base_length = fragment.length;
-
-				// loop over the text
-				while (true) {
-					// find the first occurrence of a given special token in this fragment
-					//  passing offset argument only limit the "search area" but match coordinates
-					//  are still relative to the source full raw_text
-					auto match =
-						raw_text.find(special_token, raw_text_base_offset);
-
-					// no occurrences found, stop processing this fragment for a given special token
-					if (match == std::string::npos)
-						break;
+			if (fragment.type != FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
+				result.push_back(fragment);
+				continue;
+			}
 
-					// check if match is within bounds of offset <-> length
-					if (match + special_token.length() >
-						raw_text_base_offset + raw_text_base_length)
-						break;
+			uint64_t raw_text_base_offset = fragment.offset;
+			uint64_t raw_text_base_length = fragment.length;
 
-#ifdef PRETOKENIZERDEBUG
-					LLAMA_LOG_WARN(
-						"FF: (%ld %ld %ld) '%s'\n",
-						raw_text->length(),
-						raw_text_base_offset,
-						raw_text_base_length,
-						raw_text
-							->substr(raw_text_base_offset, raw_text_base_length)
-							.c_str()
-					);
-#endif
-					auto source = std::distance(buffer.begin(), it);
-
-					// if match is further than base offset
-					//  then we have some text to the left of it
-					if (match > raw_text_base_offset) {
-						// left
-						const int64_t left_reminder_offset =
-							raw_text_base_offset + 0;
-						int64_t left_reminder_length =
-							match - raw_text_base_offset;
-
-						if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
-							while (left_reminder_length > 0 &&
-								   isspace(raw_text
-											   [left_reminder_offset +
-												left_reminder_length - 1])) {
-								left_reminder_length--;
-							}
-						}
+			// loop over the text
+			while (true) {
+				while (next_match < last &&
+					   matches[next_match].pos < raw_text_base_offset) {
+					next_match++;
+				}
 
-						if (left_reminder_length > 0) {
-							buffer.emplace_after(
-								it,
-								raw_text,
-								left_reminder_offset,
-								left_reminder_length
-							);
-							it++;
+				// no occurrence within this fragment, keep what is left of it
+				if (next_match == last ||
+					matches[next_match].pos + special_token.length() >
+						raw_text_base_offset + raw_text_base_length) {
+					if (raw_text_base_length > 0) {
+						result.emplace_back(
+							raw_text_base_offset, raw_text_base_length
+						);
+					}
+					break;
+				}
+				const uint64_t match = matches[next_match].pos;
+
+				// if match is further than base offset
+				//  then we have some text to the left of it
+				if (match > raw_text_base_offset) {
+					// left
+					const int64_t left_reminder_offset =
+						raw_text_base_offset + 0;
+					int64_t left_reminder_length = match - raw_text_base_offset;
+
+					if (data.attr & LLAMA_TOKEN_ATTR_LSTRIP) {
+						while (left_reminder_length > 0 &&
+							   isspace(raw_text
+										   [left_reminder_offset +
+											left_reminder_length - 1])) {
+							left_reminder_length--;
 						}
+					}
 
-#ifdef PRETOKENIZERDEBUG
-						LLAMA_LOG_WARN(
-							"FL: (%ld %ld) '%s'\n",
-							left_reminder_offset,
-							left_reminder_length,
-							raw_text
-								->substr(
-									left_reminder_offset, left_reminder_length
-								)
-								.c_str()
+					if (left_reminder_length > 0) {
+						result.emplace_back(
+							left_reminder_offset, left_reminder_length
 						);
-#endif
 					}
+				}
 
-					// special token
-					buffer.emplace_after(it, special_id);
-					it++;
+				// special token
+				result.emplace_back(special_id);
 
-					// right
-					if (match + special_token.length() <
-						raw_text_base_offset + raw_text_base_length) {
-						int64_t right_reminder_offset =
-							match + special_token.length();
-						int64_t right_reminder_length =
-							raw_text_base_length -
-							((match - raw_text_base_offset) +
-							 special_token.length());
-
-						if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
-							while (right_reminder_length > 0 &&
-								   isspace(raw_text[right_reminder_offset])) {
-								right_reminder_offset++;
-								right_reminder_length--;
-							}
-						}
+				// right
+				if (match + special_token.length() >=
+					raw_text_base_offset + raw_text_base_length) {
+					break;
+				}
+				int64_t right_reminder_offset = match + special_token.length();
+				int64_t right_reminder_length =
+					raw_text_base_length -
+					((match - raw_text_base_offset) + special_token.length());
+
+				if (data.attr & LLAMA_TOKEN_ATTR_RSTRIP) {
+					while (right_reminder_length > 0 &&
+						   isspace(raw_text[right_reminder_offset])) {
+						right_reminder_offset++;
+						right_reminder_length--;
+					}
+				}
 
-						if (right_reminder_length > 0) {
-							buffer.emplace_after(
-								it,
-								raw_text,
-								right_reminder_offset,
-								right_reminder_length
-							);
-							it++;
-						}
+				// repeat for the right side
+				raw_text_base_offset = right_reminder_offset;
+				raw_text_base_length = right_reminder_length;
+			}
+		}
+		buffer.swap(result);
+	}
+}
 
-#ifdef PRETOKENIZERDEBUG
-						LLAMA_LOG_WARN(
-							"FR: (%ld %ld) '%s'\n",
-							right_reminder_offset,
-							right_reminder_length,
-							raw_text
-								->substr(
-									right_reminder_offset, right_reminder_length
-								)
-								.c_str()
-						);
-#endif
+// raw text fragments shorter than this are not worth starting threads for
+static const size_t LLAMA_TOKENIZE_PARALLEL_MIN_BYTES = 16 * 1024;
+
+// Splits items [0, n_items) of a fragment into up to n_threads contiguous
+// chunks, tokenizes the chunks on their own threads and appends the outputs in
+// order. The items must tokenize independently of each other, then the result
+// is the same as tokenize_chunk(0, n_items, output).
+static void llama_tokenize_chunks(
+	size_t n_items, int n_threads, std::vector<llama_vocab::id> &output,
+	const std::function<
+		void(size_t, size_t, std::vector<llama_vocab::id> &)> &tokenize_chunk
+) {
+	const size_t n_chunks = std::min<size_t>(std::max(n_threads, 1), n_items);
+	if (n_chunks <= 1) {
+		tokenize_chunk(0, n_items, output);
+		return;
+	}
 
-						if (source == 0) {
-							buffer.erase_after(buffer.before_begin());
-						} else {
-							buffer.erase_after(
-								std::next(buffer.begin(), (source - 1))
-							);
-						}
+	std::vector<std::vector<llama_vocab::id>> outputs(n_chunks);
+	std::vector<std::exception_ptr> errors(n_chunks);
+	auto run = [&](size_t chunk) {
+		try {
+			tokenize_chunk(
+				chunk * n_items / n_chunks,
+				(chunk + 1) * n_items / n_chunks,
+				outputs[chunk]
+			);
+		} catch (...) {
+			errors[chunk] = std::current_exception();
+		}
+	};
 
-						// repeat for the right side
-						raw_text_base_offset = right_reminder_offset;
-						raw_text_base_length = right_reminder_length;
+	std::vector<std::thread> workers;
+	workers.reserve(n_chunks - 1);
+	for (size_t chunk = 1; chunk < n_chunks; ++chunk) {
+		workers.emplace_back(run, chunk);
+	}
+	run(0);
+	for (auto &worker : workers) {
+		worker.join();
+	}
 
-#ifdef PRETOKENIZERDEBUG
-						LLAMA_LOG_WARN(
-							"RR: (%ld %ld) '%s'\n",
-							raw_text_base_offset,
-							raw_text_base_length,
-							raw_text
-								->substr(
-									raw_text_base_offset, raw_text_base_length
-								)
-								.c_str()
-						);
-#endif
-					} else {
-						if (source == 0) {
-							buffer.erase_after(buffer.before_begin());
-						} else {
-							buffer.erase_after(
-								std::next(buffer.begin(), (source - 1))
-							);
-						}
-						break;
-					}
-				}
-			}
-			it++;
+	for (size_t chunk = 0; chunk < n_chunks; ++chunk) {
+		if (errors[chunk]) {
+			std::rethrow_exception(errors[chunk]);
 		}
+		output.insert(
+			output.end(), outputs[chunk].begin(), outputs[chunk].end()
+		);
 	}
 }
 
+// Same as above for a text cut into segments at the given offsets.
+static void llama_tokenize_text_chunks(
+	const std::string &text, const std::vector<size_t> &cuts, int n_threads,
+	std::vector<llama_vocab::id> &output,
+	const std::function<
+		void(const std::string &, std::vector<llama_vocab::id> &)> &tokenize_text
+) {
+	llama_tokenize_chunks(
+		cuts.size() + 1,
+		n_threads,
+		output,
+		[&](size_t begin, size_t end, std::vector<llama_vocab::id> &out) {
+			const size_t first = begin == 0 ? 0 : cuts[begin - 1];
+			const size_t last  = end > cuts.size() ? text.size() : cuts[end - 1];
+			tokenize_text(text.substr(first, last - first), out);
+		}
+	);
+}
+
+// Offsets in the escaped SPM text where a "\xe2\x96\x81" (escaped space) symbol
+// follows a symbol that does not end in 0x81. With
+// vocab.tokenizer_spm_space_boundaries, no merge can cross them. The walk
+// over the symbols is the same as in llm_tokenizer_spm::tokenize.
+static std::vector<size_t> llama_spm_space_cuts(const std::string &text) {
+	std::vector<size_t> cuts;
+	size_t offs = 0;
+	while (offs < text.size()) {
+		if (offs > 0 && (uint8_t)text[offs - 1] != 0x81 &&
+			text.compare(offs, 3, "\xe2\x96\x81") == 0) {
+			cuts.push_back(offs);
+		}
+		offs += std::min<size_t>(
+			unicode_len_utf8(text[offs]), text.size() - offs
+		);
+	}
+	return cuts;
+}
+
+// Offsets of the ASCII whitespace in text, the WPM pre-tokenizer always
+// ends a word there.
+static std::vector<size_t> llama_wpm_space_cuts(const std::string &text) {
+	std::vector<size_t> cuts;
+	for (size_t i = 1; i < text.size(); ++i) {
+		const char c = text[i];
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+			cuts.push_back(i);
+		}
+	}
+	return cuts;
+}
+
 std::vector<llama_vocab::id> llama_tokenize_internal(
 	const llama_vocab &vocab,
 	std::string raw_text,
 	bool add_special,
-	bool parse_special
+	bool parse_special,
+	int n_threads
 ) {
 	std::vector<llama_vocab::id> output;
-	std::forward_list<fragment_buffer_variant> fragment_buffer;
+	std::vector<fragment_buffer_variant> fragment_buffer;
 
 	if (!raw_text.empty()) {
-		fragment_buffer.emplace_front(raw_text, 0, raw_text.length());
-		tokenizer_st_partition(vocab, fragment_buffer, parse_special);
+		fragment_buffer.emplace_back(0, raw_text.length());
+		tokenizer_st_partition(vocab, raw_text, fragment_buffer, parse_special);
 	}
 
 	switch (vocab.type) {
@@ -1924,26 +2450,40 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 
 		for (const auto &fragment : fragment_buffer) {
 			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto raw_text =
-					fragment.raw_text.substr(fragment.offset, fragment.length);
+				auto text = raw_text.substr(fragment.offset, fragment.length);
 
 				// prefix with space if previous is special
 				if (vocab.tokenizer_add_space_prefix && is_prev_special) {
-					raw_text = " " + raw_text;
+					text = " " + text;
 				}
 
 #ifdef PRETOKENIZERDEBUG
 				LLAMA_LOG_WARN(
 					"TT: (%ld %ld %ld) '%s'\n",
-					raw_text.length(),
+					text.length(),
 					fragment.offset,
 					fragment.length,
-					raw_text.c_str()
+					text.c_str()
 				);
 #endif
-				llm_tokenizer_spm tokenizer(vocab);
-				llama_escape_whitespace(raw_text);
-				tokenizer.tokenize(raw_text, output);
+				llama_escape_whitespace(text);
+				if (n_threads > 1 && vocab.tokenizer_spm_space_boundaries &&
+					text.size() >= LLAMA_TOKENIZE_PARALLEL_MIN_BYTES) {
+					llama_tokenize_text_chunks(
+						text,
+						llama_spm_space_cuts(text),
+						n_threads,
+						output,
+						[&](const std::string &chunk,
+							std::vector<llama_vocab::id> &out) {
+							llm_tokenizer_spm tokenizer(vocab);
+							tokenizer.tokenize(chunk, out);
+						}
+					);
+				} else {
+					llm_tokenizer_spm tokenizer(vocab);
+					tokenizer.tokenize(text, output);
+				}
 				is_prev_special = false;
 			} else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
 				output.push_back(fragment.token);
@@ -1977,19 +2517,35 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 		}
 		for (const auto &fragment : fragment_buffer) {
 			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto raw_text =
-					fragment.raw_text.substr(fragment.offset, fragment.length);
+				auto text = raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
 				LLAMA_LOG_WARN(
 					"TT: (%ld %ld %ld) '%s'\n",
-					raw_text.length(),
+					text.length(),
 					fragment.offset,
 					fragment.length,
-					raw_text.c_str()
+					text.c_str()
 				);
 #endif
-				tokenizer.tokenize(raw_text, output);
+				if (n_threads > 1 &&
+					text.size() >= LLAMA_TOKENIZE_PARALLEL_MIN_BYTES) {
+					// the regex split is serial, the merges run per word
+					const auto words = tokenizer.split(text);
+					llama_tokenize_chunks(
+						words.size(),
+						n_threads,
+						output,
+						[&](size_t begin,
+							size_t end,
+							std::vector<llama_vocab::id> &out) {
+							llm_tokenizer_bpe chunk_tokenizer(vocab);
+							chunk_tokenizer.tokenize(words, begin, end, out);
+						}
+					);
+				} else {
+					tokenizer.tokenize(text, output);
+				}
 			} else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
 				tokenizer.append(fragment.token, output);
 			}
@@ -2010,19 +2566,32 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 
 		for (const auto &fragment : fragment_buffer) {
 			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto raw_text =
-					fragment.raw_text.substr(fragment.offset, fragment.length);
+				auto text = raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
 				LLAMA_LOG_WARN(
 					"TT: (%ld %ld %ld) '%s'\n",
-					raw_text.length(),
+					text.length(),
 					fragment.offset,
 					fragment.length,
-					raw_text.c_str()
+					text.c_str()
 				);
 #endif
-				tokenizer.tokenize(raw_text, output);
+				if (n_threads > 1 &&
+					text.size() >= LLAMA_TOKENIZE_PARALLEL_MIN_BYTES) {
+					llama_tokenize_text_chunks(
+						text,
+						llama_wpm_space_cuts(text),
+						n_threads,
+						output,
+						[&](const std::string &chunk,
+							std::vector<llama_vocab::id> &out) {
+							tokenizer.tokenize(chunk, out);
+						}
+					);
+				} else {
+					tokenizer.tokenize(text, output);
+				}
 			} else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
 				output.push_back(fragment.token);
 			}
@@ -2043,18 +2612,17 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 
 		for (const auto &fragment : fragment_buffer) {
 			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto raw_text =
-					fragment.raw_text.substr(fragment.offset, fragment.length);
+				auto text = raw_text.substr(fragment.offset, fragment.length);
 #ifdef PRETOKENIZERDEBUG
 				LLAMA_LOG_WARN(
 					"TT: (%ld %ld %ld) '%s'\n",
-					raw_text.length(),
+					text.length(),
 					fragment.offset,
 					fragment.length,
-					raw_text.c_str()
+					text.c_str()
 				);
 #endif
-				tokenizer.tokenize(raw_text, output);
+				tokenizer.tokenize(text, output);
 			} else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
 				output.push_back(fragment.token);
 			}
@@ -2081,21 +2649,20 @@ std::vector<llama_vocab::id> llama_tokenize_internal(
 	case LLAMA_VOCAB_TYPE_RWKV: {
 		for (const auto &fragment : fragment_buffer) {
 			if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_RAW_TEXT) {
-				auto raw_text =
-					fragment.raw_text.substr(fragment.offset, fragment.length);
+				auto text = raw_text.substr(fragment.offset, fragment.length);
 
 #ifdef PRETOKENIZERDEBUG
 				LLAMA_LOG_WARN(
 					"TT: (%ld %ld %ld) '%s'\n",
-					raw_text.length(),
+					text.length(),
 					fragment.offset,
 					fragment.length,
-					raw_text.c_str()
+					text.c_str()
 				);
 #endif
 
 				llm_tokenizer_rwkv tokenizer(vocab);
-				tokenizer.tokenize(raw_text, output);
+				tokenizer.tokenize(text, output);
 			} else { // if (fragment.type == FRAGMENT_BUFFER_VARIANT_TYPE_TOKEN)
 				output.push_back(fragment.token);
 			}
@@ -2116,8 +2683,8 @@ llama_token llama_byte_to_token_impl(const llama_vocab &vocab, uint8_t ch) {
 	case LLAMA_VOCAB_TYPE_UGM: {
 		const char buf[7] = {'<', '0', 'x', hex[ch >> 4], hex[ch & 15], '>', 0};
 		auto token		  = vocab.token_to_id.find(buf);
-		if (token != vocab.token_to_id.end()) {
-			return (*token).second;
+		if (token >= 0) {
+			return token;
 		}
 		// Try to fall back to just the byte as a string
 		const char buf2[2] = {(char)ch, 0};
@@ -2581,7 +3148,10 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 					second = word.substr(pos + 1);
 				}
 
-				vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+				// the first occurrence of a pair keeps its rank
+				if (vocab.bpe_ranks.find(first, second) < 0) {
+					vocab.bpe_ranks.insert(first, second, i);
+				}
 			}
 
 			// default special tokens
@@ -2825,12 +3395,13 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 
 	vocab.n_vocab = n_vocab;
 	vocab.id_to_token.resize(n_vocab);
+	vocab.token_to_id.reserve(n_vocab);
 
 	for (uint32_t i = 0; i < n_vocab; i++) {
 		std::string word = gguf_get_arr_str(ctx, token_idx, i);
 		GGML_ASSERT(unicode_cpts_from_utf8(word).size() > 0);
 
-		vocab.token_to_id[word] = i;
+		vocab.token_to_id.insert(word, i);
 		vocab.max_token_len = std::max(vocab.max_token_len, (int)word.size());
 
 		auto &token_data = vocab.id_to_token[i];
@@ -3007,20 +3578,22 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 		// TODO: convert scripts should provide this token through the KV metadata LLAMA_KV_TOKENIZER_EOT_ID
 		//       for now, we apply this workaround to find the EOT token based on its text
 		if (vocab.special_eot_id == -1) {
-			for (const auto &t : vocab.token_to_id) {
+			for (llama_vocab::id id = 0; id < (llama_vocab::id)vocab.n_vocab;
+				 id++) {
+				const auto &text = vocab.id_to_token[id].text;
 				if (
                         // TODO: gemma "<end_of_turn>" is exported as a normal token, so the following check does not work
                         //       need to fix convert script
-                        //vocab.id_to_token[t.second].type == LLAMA_TOKEN_TYPE_CONTROL &&
-                        (t.first == "<|eot_id|>" ||
-                         t.first == "<|im_end|>" ||
-                         t.first == "<|end|>" ||
-                         t.first == "<end_of_turn>" ||
-                         t.first == "<|endoftext|>"
+                        //vocab.id_to_token[id].type == LLAMA_TOKEN_TYPE_CONTROL &&
+                        (text == "<|eot_id|>" ||
+                         text == "<|im_end|>" ||
+                         text == "<|end|>" ||
+                         text == "<end_of_turn>" ||
+                         text == "<|endoftext|>"
                         )
                    ) {
-					vocab.special_eot_id = t.second;
-					if ((vocab.id_to_token[t.second].attr &
+					vocab.special_eot_id = id;
+					if ((vocab.id_to_token[id].attr &
 						 LLAMA_TOKEN_ATTR_CONTROL) == 0) {
 						// fprintf(
 						// 	stderr,
@@ -3028,10 +3601,9 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 						// 	"control-type; this is probably a bug in the "
 						// 	"model. its type will be overridden\n",
 						// 	__func__,
-						// 	t.first.c_str()
+						// 	text.c_str()
 						// );
-						vocab.id_to_token[t.second].attr =
-							LLAMA_TOKEN_ATTR_CONTROL;
+						vocab.id_to_token[id].attr = LLAMA_TOKEN_ATTR_CONTROL;
 					}
 					break;
 				}
@@ -3043,21 +3615,20 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 		// TODO: convert scripts should provide this token through the KV metadata LLAMA_KV_TOKENIZER_EOM_ID
 		//       for now, we apply this workaround to find the EOM token based on its text
 		if (vocab.special_eom_id == -1) {
-			const auto &t = vocab.token_to_id.find("<|eom_id|>");
-			if (t != vocab.token_to_id.end()) {
-				vocab.special_eom_id = t->second;
-				if ((vocab.id_to_token[t->second].attr &
-					 LLAMA_TOKEN_ATTR_CONTROL) == 0) {
+			const auto t = vocab.token_to_id.find("<|eom_id|>");
+			if (t >= 0) {
+				vocab.special_eom_id = t;
+				if ((vocab.id_to_token[t].attr & LLAMA_TOKEN_ATTR_CONTROL) ==
+					0) {
 					fprintf(
 						stderr,
 						"%s: control-looking token: '%s' was not control-type; "
 						"this is probably a bug in the model. its type will be "
 						"overridden\n",
 						__func__,
-						t->first.c_str()
+						vocab.id_to_token[t].text.c_str()
 					);
-					vocab.id_to_token[t->second].attr =
-						LLAMA_TOKEN_ATTR_CONTROL;
+					vocab.id_to_token[t].attr = LLAMA_TOKEN_ATTR_CONTROL;
 				}
 			}
 		}
@@ -3083,6 +3654,13 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 		);
 
 		// printf("%s: special tokens cache size = %u\n", __func__, (uint32_t)vocab.cache_special_tokens.size());
+
+		std::vector<std::string_view> patterns;
+		patterns.reserve(vocab.cache_special_tokens.size());
+		for (const auto id : vocab.cache_special_tokens) {
+			patterns.emplace_back(vocab.id_to_token[id].text);
+		}
+		vocab.special_token_matcher.build(patterns);
 	}
 
 	// build token to piece cache
@@ -3167,4 +3745,252 @@ void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx) {
 			}
 		}
 	}
+
+	// build the tries for the longest-prefix matching in the tokenizers
+	{
+		std::vector<std::pair<std::string_view, int32_t>> keys;
+		std::vector<std::pair<std::string_view, int32_t>> user_defined_keys;
+		// RWKV supports arbitrary byte tokens, but the vocab struct only supports
+		// string tokens, so the trie is built over the unescaped bytes
+		std::vector<std::string> rwkv_tokens;
+
+		switch (vocab.type) {
+		case LLAMA_VOCAB_TYPE_SPM:
+		case LLAMA_VOCAB_TYPE_WPM:
+			for (uint32_t id = 0; id < n_vocab; ++id) {
+				keys.emplace_back(vocab.id_to_token[id].text, id);
+			}
+			if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
+				vocab.tokenizer_spm_space_boundaries = true;
+				for (const auto &token : vocab.id_to_token) {
+					for (size_t pos = token.text.find("\xe2\x96\x81", 1);
+						 pos != std::string::npos;
+						 pos = token.text.find("\xe2\x96\x81", pos + 1)) {
+						if ((uint8_t)token.text[pos - 1] != 0x81) {
+							vocab.tokenizer_spm_space_boundaries = false;
+						}
+					}
+				}
+			}
+			break;
+		case LLAMA_VOCAB_TYPE_UGM:
+			for (uint32_t id = 0; id < n_vocab; ++id) {
+				const auto &text = vocab.id_to_token[id].text;
+				if (llama_is_normal_token(vocab, id) ||
+					llama_is_user_defined_token(vocab, id) ||
+					llama_is_unused_token(vocab, id)) {
+					keys.emplace_back(text, id);
+				}
+				if (llama_is_user_defined_token(vocab, id)) {
+					user_defined_keys.emplace_back(text, id);
+				}
+			}
+			break;
+		case LLAMA_VOCAB_TYPE_RWKV:
+			rwkv_tokens.reserve(n_vocab);
+			for (uint32_t id = 0; id < n_vocab; ++id) {
+				const auto data =
+					llama_unescape_rwkv_token(vocab.id_to_token[id].text);
+				rwkv_tokens.emplace_back(data.begin(), data.end());
+				keys.emplace_back(rwkv_tokens.back(), id);
+			}
+			break;
+		default:
+			break;
+		}
+
+		vocab.token_trie.build(keys);
+		vocab.user_defined_trie.build(user_defined_keys);
+	}
+}
+
+static const uint32_t LLAMA_VOCAB_SNAPSHOT_MAGIC   = 0x42434f56; // "VOCB"
+static const uint32_t LLAMA_VOCAB_SNAPSHOT_VERSION = 1;
+
+// the scalar members of llama_vocab, in snapshot order
+template <typename Vocab, typename F>
+static void llama_vocab_scalars(Vocab &vocab, F &&field) {
+	field(vocab.n_vocab);
+	field(vocab.type);
+	field(vocab.type_pre);
+	field(vocab.max_token_len);
+
+	field(vocab.special_bos_id);
+	field(vocab.special_eos_id);
+	field(vocab.special_unk_id);
+	field(vocab.special_sep_id);
+	field(vocab.special_pad_id);
+	field(vocab.special_cls_id);
+	field(vocab.special_mask_id);
+	field(vocab.linefeed_id);
+	field(vocab.special_prefix_id);
+	field(vocab.special_suffix_id);
+	field(vocab.special_middle_id);
+	field(vocab.special_eot_id);
+	field(vocab.special_eom_id);
+
+	field(vocab.tokenizer_add_space_prefix);
+	field(vocab.tokenizer_add_bos);
+	field(vocab.tokenizer_add_eos);
+	field(vocab.tokenizer_ignore_merges);
+	field(vocab.tokenizer_clean_spaces);
+	field(vocab.tokenizer_remove_extra_whitespaces);
+	field(vocab.tokenizer_escape_whitespaces);
+	field(vocab.tokenizer_treat_whitespace_as_suffix);
+	field(vocab.tokenizer_spm_space_boundaries);
+}
+
+// n strings as their lengths followed by one blob of all their bytes
+template <typename Get>
+static void llama_vocab_save_strings(
+	llama_vocab_writer &writer, size_t n, Get &&get
+) {
+	std::vector<uint32_t> lengths(n);
+	size_t total = 0;
+	for (size_t i = 0; i < n; ++i) {
+		lengths[i] = get(i).size();
+		total += lengths[i];
+	}
+	writer.array(lengths);
+	writer.pod<uint64_t>(total);
+	for (size_t i = 0; i < n; ++i) {
+		writer.bytes(get(i).data(), lengths[i]);
+	}
+}
+
+// the strings are copied out one by one: token_data::text and the pieces are
+// std::strings that outlive the snapshot, which is unmapped once it is loaded.
+// Pointing them into the blob would mean keeping the mapping alive for the
+// lifetime of the vocab.
+template <typename Set>
+static void llama_vocab_load_strings(
+	llama_vocab_reader &reader, size_t n, Set &&set
+) {
+	size_t n_lengths;
+	const char *lengths_data = reader.array<uint32_t>(n_lengths);
+	const uint64_t total	 = reader.pod<uint64_t>();
+	const char *blob		 = reader.bytes(total);
+	if (!reader.ok || n_lengths != n) {
+		reader.ok = false;
+		return;
+	}
+	uint64_t offset = 0;
+	for (size_t i = 0; i < n; ++i) {
+		uint32_t length;
+		memcpy(&length, lengths_data + i * sizeof(uint32_t), sizeof(length));
+		if (length > total - offset) {
+			reader.ok = false;
+			return;
+		}
+		set(i, std::string_view(blob + offset, length));
+		offset += length;
+	}
+}
+
+void llama_vocab_save(const llama_vocab &vocab, std::vector<char> &out) {
+	llama_vocab_writer writer{out};
+	writer.pod(LLAMA_VOCAB_SNAPSHOT_MAGIC);
+	writer.pod(LLAMA_VOCAB_SNAPSHOT_VERSION);
+
+	llama_vocab_scalars(vocab, [&](const auto &value) { writer.pod(value); });
+
+	const size_t n_tokens = vocab.id_to_token.size();
+	writer.pod<uint64_t>(n_tokens);
+	llama_vocab_save_strings(writer, n_tokens, [&](size_t i) -> const auto & {
+		return vocab.id_to_token[i].text;
+	});
+	std::vector<float> scores(n_tokens);
+	std::vector<llama_token_attr> attrs(n_tokens);
+	for (size_t i = 0; i < n_tokens; ++i) {
+		scores[i] = vocab.id_to_token[i].score;
+		attrs[i]  = vocab.id_to_token[i].attr;
+	}
+	writer.array(scores);
+	writer.array(attrs);
+
+	vocab.token_to_id.save(writer);
+	vocab.token_trie.save(writer);
+	vocab.user_defined_trie.save(writer);
+	writer.array(vocab.cache_special_tokens);
+	vocab.special_token_matcher.save(writer);
+
+	const auto &pieces = vocab.cache_token_to_piece;
+	writer.pod<uint64_t>(pieces.size());
+	llama_vocab_save_strings(
+		writer,
+		pieces.size(),
+		[&](size_t i) -> const auto & { return pieces[i]; }
+	);
+
+	vocab.bpe_ranks.save(writer);
+	writer.array(vocab.precompiled_charsmap);
+}
+
+bool llama_vocab_load(llama_vocab &vocab, const char *data, size_t size) {
+	llama_vocab_reader reader{data, data + size};
+	if (reader.pod<uint32_t>() != LLAMA_VOCAB_SNAPSHOT_MAGIC ||
+		reader.pod<uint32_t>() != LLAMA_VOCAB_SNAPSHOT_VERSION) {
+		return false;
+	}
+
+	llama_vocab_scalars(vocab, [&](auto &value) {
+		value = reader.pod<std::remove_reference_t<decltype(value)>>();
+	});
+
+	const size_t n_tokens = reader.pod<uint64_t>();
+	if (!reader.ok || n_tokens != vocab.n_vocab) {
+		return false;
+	}
+	vocab.id_to_token.resize(n_tokens);
+	llama_vocab_load_strings(
+		reader,
+		n_tokens,
+		[&](size_t i, std::string_view text) {
+			vocab.id_to_token[i].text.assign(text);
+		}
+	);
+	std::vector<float> scores;
+	std::vector<llama_token_attr> attrs;
+	reader.array(scores);
+	reader.array(attrs);
+	if (!reader.ok || scores.size() != n_tokens || attrs.size() != n_tokens) {
+		return false;
+	}
+	for (size_t i = 0; i < n_tokens; ++i) {
+		vocab.id_to_token[i].score = scores[i];
+		vocab.id_to_token[i].attr  = attrs[i];
+	}
+
+	// the tables hold token ids, which index id_to_token without checks
+	vocab.token_to_id.load(reader, n_tokens);
+	vocab.token_trie.load(reader, n_tokens);
+	vocab.user_defined_trie.load(reader, n_tokens);
+	reader.array(vocab.cache_special_tokens);
+	std::vector<std::string_view> patterns;
+	patterns.reserve(vocab.cache_special_tokens.size());
+	for (const auto id : vocab.cache_special_tokens) {
+		if (id < 0 || (size_t)id >= n_tokens) {
+			return false;
+		}
+		patterns.emplace_back(vocab.id_to_token[id].text);
+	}
+	vocab.special_token_matcher.load(reader, patterns);
+
+	const size_t n_pieces = reader.pod<uint64_t>();
+	if (!reader.ok || (n_pieces != 0 && n_pieces != n_tokens)) {
+		return false;
+	}
+	vocab.cache_token_to_piece.resize(n_pieces);
+	llama_vocab_load_strings(
+		reader,
+		n_pieces,
+		[&](size_t i, std::string_view piece) {
+			vocab.cache_token_to_piece[i].assign(piece);
+		}
+	);
+
+	vocab.bpe_ranks.load(reader, INT32_MAX);
+	reader.array(vocab.precompiled_charsmap);
+
+	return reader.ok && reader.cur == reader.end;
 }
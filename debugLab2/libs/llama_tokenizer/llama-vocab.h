@@ -1,8 +1,11 @@
 #pragma once
 
 #include <cstdint>
+#include <list>
 #include <map>
+#include <mutex>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -156,6 +159,177 @@ struct llama_tokenizer_config {
 	bool add_eos;
 };
 
+// serialization of the vocab tables, see llama_vocab_save()
+struct llama_vocab_writer;
+struct llama_vocab_reader;
+
+// Open-addressing (linear probing) hash table from strings to non-negative
+// ids. All keys live in a single arena and lookups take string_views, so a
+// lookup never allocates. A key may also be a pair of strings, which is how the
+// BPE merge ranks are stored: the pair is hashed and compared piecewise, so the
+// merge loop does not have to build "left right" strings either.
+struct llama_token_map {
+	// inserts or overwrites key -> value, value must be >= 0
+	void insert(std::string_view key, int32_t value);
+	void insert(std::string_view left, std::string_view right, int32_t value);
+
+	// returns -1 if the key is not present
+	int32_t find(std::string_view key) const;
+	int32_t find(std::string_view left, std::string_view right) const;
+
+	// like find(), but throws std::out_of_range if the key is not present
+	int32_t at(std::string_view key) const;
+
+	size_t size() const { return n_keys; }
+	bool empty() const { return n_keys == 0; }
+	void reserve(size_t n);
+
+	void save(llama_vocab_writer &writer) const;
+	// values must be below value_end, a table that does not hold sets the
+	// reader to failed
+	void load(llama_vocab_reader &reader, int32_t value_end);
+
+  private:
+	struct slot {
+		uint64_t hash	= 0;
+		uint32_t offset = 0; // key bytes in the arena
+		uint32_t len	= 0;
+		uint32_t split	= 0; // length of the left part of a pair key
+		int32_t value	= -1; // -1 marks an empty slot
+	};
+
+	int64_t lookup(
+		uint64_t hash, std::string_view left, std::string_view right,
+		bool is_pair
+	) const;
+	void insert(
+		std::string_view left, std::string_view right, bool is_pair,
+		int32_t value
+	);
+
+	std::vector<char> arena;
+	std::vector<slot> slots; // size is 0 or a power of two
+	size_t n_keys = 0;
+};
+
+// Double-array trie from byte strings to non-negative ids, used for the
+// longest-prefix matching in the tokenizers. The child of node s by byte c is
+// t = base[s] + c, which is valid iff check[t] == s, so walking a key costs one
+// access into a single contiguous array per byte.
+struct llama_token_trie {
+	static constexpr int32_t root = 0;
+
+	// builds the trie from scratch, a later duplicate key overwrites the value
+	// of an earlier one
+	void build(const std::vector<std::pair<std::string_view, int32_t>> &keys);
+
+	// returns the child of node by byte c, or -1
+	int32_t child(int32_t node, uint8_t c) const {
+		const int32_t next = units[node].base + c;
+		if ((size_t)next < units.size() && units[next].check == node) {
+			return next;
+		}
+		return -1;
+	}
+	// returns the value of the key ending in node, or -1
+	int32_t value(int32_t node) const { return units[node].value; }
+
+	// returns -1 if the key is not present
+	int32_t find(std::string_view key) const;
+	// length and value of the longest key that is a prefix of text, {0, -1} if
+	// there is none
+	std::pair<size_t, int32_t> longest_prefix(std::string_view text) const;
+
+	bool empty() const { return units.size() == 1 && units[0].value < 0; }
+
+	void save(llama_vocab_writer &writer) const;
+	// values must be below value_end, a trie that does not hold sets the
+	// reader to failed
+	void load(llama_vocab_reader &reader, int32_t value_end);
+
+  private:
+	struct unit {
+		int32_t base  = 0;
+		int32_t check = -1; // parent node, -1 marks a free unit
+		int32_t value = -1;
+	};
+
+	std::vector<unit> units = std::vector<unit>(1);
+};
+
+// Least-recently-used cache of pre-tokenized words to their BPE token ids.
+// Shared by all tokenize calls on the same vocab. The words are spread over
+// shards by their hash, each with its own mutex and its own share of the
+// capacity, so concurrent tokenize calls rarely wait on the same lock.
+struct llama_bpe_word_cache {
+	explicit llama_bpe_word_cache(size_t capacity = 8192)
+		: capacity(capacity) {}
+	// copies start out empty
+	llama_bpe_word_cache(const llama_bpe_word_cache &other)
+		: capacity(other.capacity) {}
+	llama_bpe_word_cache &operator=(const llama_bpe_word_cache &other) {
+		capacity = other.capacity;
+		for (auto &sh : shards) {
+			std::lock_guard<std::mutex> lock(sh.mutex);
+			sh.entries.clear();
+			sh.index.clear();
+		}
+		return *this;
+	}
+
+	// appends the cached ids of word to output, returns false on a miss
+	bool get(const std::string &word, std::vector<llama_token> &output);
+	void put(const std::string &word, std::vector<llama_token> ids);
+
+  private:
+	using entry = std::pair<std::string, std::vector<llama_token>>;
+
+	struct shard {
+		std::mutex mutex;
+		std::list<entry> entries; // most recently used first
+		std::unordered_map<std::string_view, std::list<entry>::iterator> index;
+	};
+	static constexpr size_t n_shards = 16;
+
+	shard &shard_of(const std::string &word) {
+		return shards[std::hash<std::string>{}(word) % n_shards];
+	}
+
+	size_t capacity; // of all shards together
+	shard shards[n_shards];
+};
+
+// Aho-Corasick automaton over the special token texts, finds the occurrences
+// of all of them in a single pass over the input. The transitions are a dense
+// table over byte classes (bytes that do not occur in any pattern share one).
+struct llama_special_token_matcher {
+	struct match {
+		uint32_t pattern; // index into the patterns given to build()
+		uint32_t pos;	  // byte offset of the first byte of the occurrence
+	};
+
+	void build(const std::vector<std::string_view> &patterns);
+	// appends every occurrence, overlapping ones included, in order of their end
+	void find_all(std::string_view text, std::vector<match> &matches) const;
+
+	bool empty() const { return lengths.empty(); }
+
+	void save(llama_vocab_writer &writer) const;
+	// patterns are the ones the automaton was built from, an automaton that
+	// does not match them sets the reader to failed
+	void load(
+		llama_vocab_reader &reader, const std::vector<std::string_view> &patterns
+	);
+
+  private:
+	uint16_t byte_class[256] = {};
+	uint32_t n_classes		 = 1;
+	std::vector<int32_t> next; // (state, class) -> state
+	std::vector<int32_t> out;  // pattern ending in the state, or -1
+	std::vector<int32_t> dict; // closest suffix state with an output, or -1
+	std::vector<uint32_t> lengths;
+};
+
 struct llama_vocab {
 	using id	= llama_token;
 	using token = std::string;
@@ -175,14 +349,23 @@ struct llama_vocab {
 
 	int max_token_len = 0; // used for optimizing longest token search
 
-	std::unordered_map<token, id> token_to_id;
+	llama_token_map token_to_id;
 	std::vector<token_data> id_to_token;
 
+	// token texts for the SPM, WPM, UGM and RWKV tokenizers, which tokens it
+	// holds depends on the vocab type (empty for BPE)
+	llama_token_trie token_trie;
+	// user-defined token texts, UGM only
+	llama_token_trie user_defined_trie;
+
 	std::vector<id> cache_special_tokens;
+	// occurrences of cache_special_tokens, pattern i is cache_special_tokens[i]
+	llama_special_token_matcher special_token_matcher;
 	std::vector<token>
 		cache_token_to_piece; // llama_token_to_piece(special = true);
 
-	std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+	llama_token_map bpe_ranks; // (left, right) -> merge rank
+	mutable llama_bpe_word_cache bpe_cache;
 
 	// default LLaMA special tokens
 	id special_bos_id  = 1;
@@ -210,11 +393,14 @@ struct llama_vocab {
 	bool tokenizer_remove_extra_whitespaces	  = false;
 	bool tokenizer_escape_whitespaces		  = true;
 	bool tokenizer_treat_whitespace_as_suffix = false;
+	// no SPM token has an escaped space after a byte other than 0x81, so the
+	// merges never cross such a space and the text can be tokenized in chunks
+	bool tokenizer_spm_space_boundaries = false;
 
 	std::vector<char> precompiled_charsmap;
 
-	int find_bpe_rank(const std::string &token_left,
-					  const std::string &token_right) const;
+	int find_bpe_rank(std::string_view token_left,
+					  std::string_view token_right) const;
 };
 
 //
@@ -223,9 +409,13 @@ struct llama_vocab {
 
 // TODO: rename to llama_tokenize_impl
 // TODO: This should probably be in llama.h
+// n_threads > 1 tokenizes large text fragments in chunks on that many threads.
+// The chunks are only cut where the tokenizer never merges across, so the
+// result is the same as the serial one. UGM and RWKV are always serial.
 std::vector<llama_vocab::id>
 llama_tokenize_internal(const llama_vocab &vocab, std::string raw_text,
-						bool add_special, bool parse_special = false);
+						bool add_special, bool parse_special = false,
+						int n_threads = 1);
 
 // TODO: move the API below as member functions of llama_vocab
 llama_token llama_byte_to_token_impl(const llama_vocab &vocab, uint8_t ch);
@@ -277,5 +467,13 @@ int32_t llama_detokenize_impl(const struct llama_vocab &vocab,
 							  bool remove_special, bool unparse_special);
 
 void llm_load_vocab(llama_vocab &vocab, struct gguf_context *ctx);
+
+// Snapshot of everything llm_load_vocab builds, so that a vocab can be loaded
+// again without parsing the GGUF file and rebuilding the lookup tables. The
+// tables are stored in their in-memory layout, a snapshot is only meant to be
+// read back by the same build.
+void llama_vocab_save(const llama_vocab &vocab, std::vector<char> &out);
+// returns false if data is not a complete snapshot of this version
+bool llama_vocab_load(llama_vocab &vocab, const char *data, size_t size);
 std::string llama_token_to_piece(const struct llama_vocab &vocab,
 								 llama_token token, bool special = true);
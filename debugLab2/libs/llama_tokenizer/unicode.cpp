@@ -1,25 +1,26 @@
-#if defined(_MSC_VER)
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING
-#endif
-
 #include "unicode.h"
 
 #include "unicode-data.h"
 
 #include <algorithm>
 #include <cassert>
-#include <codecvt>
 #include <cstddef>
 #include <cstdint>
-#include <locale>
 #include <map>
-#include <regex>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 size_t unicode_len_utf8(char src) {
 	const size_t lookup[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4};
 	uint8_t highbits	  = static_cast<uint8_t>(src) >> 4;
@@ -34,8 +35,10 @@ static std::string unicode_cpts_to_utf8(const std::vector<uint32_t> &cps) {
 	return result;
 }
 
-uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
-	assert(offset < utf8.size());
+static inline uint32_t unicode_cpt_from_utf8(
+	const char *utf8, size_t size, size_t &offset
+) {
+	assert(offset < size);
 	if (!(utf8[offset + 0] & 0x80)) {
 		auto result = utf8[offset + 0];
 		offset += 1;
@@ -45,7 +48,7 @@ uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
 		throw std::invalid_argument("invalid character");
 	}
 	if (!(utf8[offset + 0] & 0x20)) {
-		if (offset + 1 >= utf8.size() || !((utf8[offset + 1] & 0xc0) == 0x80)) {
+		if (offset + 1 >= size || !((utf8[offset + 1] & 0xc0) == 0x80)) {
 			throw std::invalid_argument("invalid character");
 		}
 		auto result =
@@ -54,7 +57,7 @@ uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
 		return result;
 	}
 	if (!(utf8[offset + 0] & 0x10)) {
-		if (offset + 2 >= utf8.size() || !((utf8[offset + 1] & 0xc0) == 0x80) ||
+		if (offset + 2 >= size || !((utf8[offset + 1] & 0xc0) == 0x80) ||
 			!((utf8[offset + 2] & 0xc0) == 0x80)) {
 			throw std::invalid_argument("invalid character");
 		}
@@ -65,7 +68,7 @@ uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
 		return result;
 	}
 	if (!(utf8[offset + 0] & 0x08)) {
-		if (offset + 3 >= utf8.size() || !((utf8[offset + 1] & 0xc0) == 0x80) ||
+		if (offset + 3 >= size || !((utf8[offset + 1] & 0xc0) == 0x80) ||
 			!((utf8[offset + 2] & 0xc0) == 0x80) ||
 			!((utf8[offset + 3] & 0xc0) == 0x80)) {
 			throw std::invalid_argument("invalid character");
@@ -80,6 +83,10 @@ uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
 	throw std::invalid_argument("failed to convert utf8 to codepoint");
 }
 
+uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset) {
+	return unicode_cpt_from_utf8(utf8.data(), utf8.size(), offset);
+}
+
 //static std::vector<uint16_t> unicode_cpt_to_utf16(uint32_t cp) {
 //    std::vector<uint16_t> result;
 //    if (/* 0x0000 <= cp && */ cp <= 0xffff) {
@@ -212,11 +219,6 @@ static std::unordered_map<std::string, uint8_t> unicode_utf8_to_byte_map() {
 	return map;
 }
 
-static inline std::wstring unicode_wstring_from_utf8(const std::string &s) {
-	std::wstring_convert<std::codecvt_utf8<wchar_t>> conv;
-	return conv.from_bytes(s);
-}
-
 static std::vector<std::string> unicode_byte_encoding_process(
 	const std::vector<std::string> &bpe_words
 ) {
@@ -239,14 +241,14 @@ static std::vector<std::string> unicode_byte_encoding_process(
 
 // GPT2 system regex:  's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
 static std::vector<size_t> unicode_regex_split_custom_gpt2(
-	const std::string &text, const std::vector<size_t> &offsets
+	const std::vector<uint32_t> &cpts,
+	const std::vector<codepoint_flags> &cpt_flags,
+	const std::vector<size_t> &offsets
 ) {
 	std::vector<size_t> bpe_offsets; // store the offset of each word
 	bpe_offsets.reserve(offsets.size()
 	); // Reserve memory for the approximate size
 
-	const auto cpts = unicode_cpts_from_utf8(text);
-
 	size_t start = 0;
 	for (auto offset : offsets) {
 		const size_t offset_ini = start;
@@ -261,9 +263,8 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(
 		};
 
 		auto _get_flags = [&](const size_t pos) -> codepoint_flags {
-			return (offset_ini <= pos && pos < offset_end)
-					   ? unicode_cpt_flags(cpts[pos])
-					   : codepoint_flags{};
+			return (offset_ini <= pos && pos < offset_end) ? cpt_flags[pos]
+														   : codepoint_flags{};
 		};
 
 		size_t _prev_end = offset_ini;
@@ -368,14 +369,14 @@ static std::vector<size_t> unicode_regex_split_custom_gpt2(
 
 // LLAMA3 system regex: "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\r\n\p{L}\p{N}]?\p{L}+|\p{N}{1,3}| ?[^\s\p{L}\p{N}]+[\r\n]*|\s*[\r\n]+|\s+(?!\S)|\s+"
 static std::vector<size_t> unicode_regex_split_custom_llama3(
-	const std::string &text, const std::vector<size_t> &offsets
+	const std::vector<uint32_t> &cpts,
+	const std::vector<codepoint_flags> &cpt_flags,
+	const std::vector<size_t> &offsets
 ) {
 	std::vector<size_t> bpe_offsets; // store the offset of each word
 	bpe_offsets.reserve(offsets.size()
 	); // Reserve memory for the approximate size
 
-	const auto cpts = unicode_cpts_from_utf8(text);
-
 	size_t start = 0;
 	for (auto offset : offsets) {
 		const size_t offset_ini = start;
@@ -390,9 +391,8 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(
 		};
 
 		auto _get_flags = [&](const size_t pos) -> codepoint_flags {
-			return (offset_ini <= pos && pos < offset_end)
-					   ? unicode_cpt_flags(cpts[pos])
-					   : codepoint_flags{};
+			return (offset_ini <= pos && pos < offset_end) ? cpt_flags[pos]
+														   : codepoint_flags{};
 		};
 
 		size_t _prev_end = offset_ini;
@@ -519,72 +519,835 @@ static std::vector<size_t> unicode_regex_split_custom_llama3(
 	return bpe_offsets;
 }
 
-// use std::wregex to split the text
-static std::vector<size_t> unicode_regex_split_stl(
-	const std::wstring &wtext,
-	const std::wstring &regex_expr,
-	const std::vector<size_t> &offsets
-) {
-	std::wregex expr(regex_expr);
-	std::vector<size_t> bpe_offsets; // store the offset of each word
-	bpe_offsets.reserve(offsets.size()
-	); // Reserve memory for the approximate size
-	size_t start = 0;
-	for (auto offset : offsets) {
-		std::wcregex_iterator it(
-			wtext.data() + start, wtext.data() + start + offset, expr
+//
+// regex engine
+//
+// The pre-tokenizer patterns without a custom implementation are compiled to
+// a small backtracking VM over "symbols": the collapsed bytes when the pattern
+// uses unicode categories, the codepoints otherwise. It implements the subset
+// of ECMAScript std::regex syntax the patterns use, with the same leftmost,
+// first-alternative-wins semantics, so the splits do not change.
+//
+
+struct unicode_regex_error : public std::runtime_error {
+	using std::runtime_error::runtime_error;
+};
+
+static constexpr uint32_t UNICODE_REGEX_SYM_MAX = 0xFFFFFFFF;
+
+// set of symbols, bitmap for the first 256 and sorted ranges for the rest
+struct unicode_regex_class {
+	uint32_t bits[8] = {};
+	std::vector<std::pair<uint32_t, uint32_t>> ranges;
+	bool negated = false;
+
+	void add(uint32_t lo, uint32_t hi) {
+		for (uint32_t c = lo; c <= hi && c < 256; ++c) {
+			bits[c >> 5] |= 1u << (c & 31);
+		}
+		if (hi >= 256) {
+			ranges.emplace_back(std::max(lo, 256u), hi);
+		}
+	}
+
+	void add(const unicode_regex_class &other) {
+		assert(!other.negated);
+		for (int i = 0; i < 8; ++i) {
+			bits[i] |= other.bits[i];
+		}
+		ranges.insert(ranges.end(), other.ranges.begin(), other.ranges.end());
+	}
+
+	// the complement of a class, as a non-negated class
+	void add_complement(const unicode_regex_class &other) {
+		assert(!other.negated);
+		for (int i = 0; i < 8; ++i) {
+			bits[i] |= ~other.bits[i];
+		}
+		uint32_t lo = 256;
+		for (const auto &r : other.ranges) {
+			if (r.first > lo) {
+				ranges.emplace_back(lo, r.first - 1);
+			}
+			if (r.second == UNICODE_REGEX_SYM_MAX) {
+				return;
+			}
+			lo = r.second + 1;
+		}
+		ranges.emplace_back(lo, UNICODE_REGEX_SYM_MAX);
+	}
+
+	// sort and merge the ranges for the binary search in test()
+	void finalize() {
+		std::sort(ranges.begin(), ranges.end());
+		size_t n = 0;
+		for (const auto &r : ranges) {
+			if (n > 0 && (ranges[n - 1].second == UNICODE_REGEX_SYM_MAX ||
+						  r.first <= ranges[n - 1].second + 1)) {
+				ranges[n - 1].second = std::max(ranges[n - 1].second, r.second);
+			} else {
+				ranges[n++] = r;
+			}
+		}
+		ranges.resize(n);
+	}
+
+	bool contains(uint32_t c) const {
+		if (c < 256) {
+			return (bits[c >> 5] >> (c & 31)) & 1;
+		}
+		auto it = std::upper_bound(
+			ranges.begin(),
+			ranges.end(),
+			c,
+			[](uint32_t c, const std::pair<uint32_t, uint32_t> &r) {
+				return c < r.first;
+			}
 		);
-		std::wcregex_iterator end;
+		return it != ranges.begin() && c <= (it - 1)->second;
+	}
 
-		int64_t start_idx = 0;
-		while (it != end) {
-			std::wcmatch match = *it;
-			if (match.position() > start_idx) {
-				bpe_offsets.emplace_back(match.position() - start_idx);
+	bool test(uint32_t c) const { return contains(c) != negated; }
+};
+
+struct unicode_regex {
+	enum op_type : uint8_t {
+		OP_SYM,		 // match symbol arg
+		OP_CLASS,	 // match a symbol in classes[arg]
+		OP_ANY,		 // match anything but a line terminator
+		OP_SPLIT,	 // continue at x, backtrack to y
+		OP_JMP,		 // continue at x
+		OP_BOL,		 // assert the beginning of the input
+		OP_EOL,		 // assert the end of the input
+		OP_LOOK,	 // lookahead at x (negative if arg), then continue at y
+		OP_MARK,	 // save the position in register arg
+		OP_PROGRESS, // fail if the position equals register arg
+		OP_MATCH,
+	};
+
+	struct inst {
+		op_type op;
+		uint32_t arg = 0;
+		int32_t x	 = 0;
+		int32_t y	 = 0;
+	};
+
+	std::vector<inst> code;
+	std::vector<unicode_regex_class> classes;
+	uint32_t n_regs = 0;
+	bool wide		= false;
+
+	// symbols a match can start with, used to skip hopeless start positions
+	bool nullable = true;
+	unicode_regex_class first;
+};
+
+// recursive descent parser from the pattern symbols to an AST, then to code
+struct unicode_regex_compiler {
+	struct node {
+		enum node_type {
+			EMPTY,
+			SYM,
+			CLASS,
+			ANY,
+			BOL,
+			EOL,
+			CAT,
+			ALT,
+			REPEAT,
+			LOOK,
+		} type;
+		uint32_t value = 0; // SYM: symbol, CLASS: class index, LOOK: negated
+		int min = 0, max = 0; // REPEAT, max < 0 for unbounded
+		bool greedy = true;
+		std::vector<int> children;
+
+		node(node_type type, uint32_t value = 0) : type(type), value(value) {}
+	};
+
+	unicode_regex_compiler(const std::vector<uint32_t> &pattern, bool wide)
+		: pattern(pattern) {
+		re.wide = wide;
+	}
+
+	unicode_regex compile() {
+		const int root = parse_alt();
+		if (pos != pattern.size()) {
+			error("unmatched ')'");
+		}
+		for (auto &cls : re.classes) {
+			cls.finalize();
+		}
+		emit(root);
+		re.code.push_back({unicode_regex::OP_MATCH});
+		re.nullable = first_set(root, re.first);
+		re.first.finalize();
+		return std::move(re);
+	}
+
+private:
+	[[noreturn]] void error(const char *what) const {
+		throw unicode_regex_error(
+			std::string(what) + " at position " + std::to_string(pos)
+		);
+	}
+
+	bool at_end() const { return pos >= pattern.size(); }
+	uint32_t peek() const { return pattern[pos]; }
+	bool accept(uint32_t c) {
+		if (!at_end() && peek() == c) {
+			pos++;
+			return true;
+		}
+		return false;
+	}
+
+	int add_node(node n) {
+		nodes.push_back(std::move(n));
+		return nodes.size() - 1;
+	}
+
+	int add_class(unicode_regex_class cls) {
+		re.classes.push_back(std::move(cls));
+		return re.classes.size() - 1;
+	}
+
+	int parse_alt() {
+		node alt{node::ALT};
+		alt.children.push_back(parse_cat());
+		while (accept('|')) {
+			alt.children.push_back(parse_cat());
+		}
+		return alt.children.size() == 1 ? alt.children[0]
+										 : add_node(std::move(alt));
+	}
+
+	int parse_cat() {
+		node cat{node::CAT};
+		while (!at_end() && peek() != '|' && peek() != ')') {
+			cat.children.push_back(parse_repeat());
+		}
+		return add_node(std::move(cat));
+	}
+
+	bool parse_int(int &value) {
+		size_t start = pos;
+		value		 = 0;
+		while (!at_end() && '0' <= peek() && peek() <= '9') {
+			value = value * 10 + (pattern[pos++] - '0');
+		}
+		return pos > start;
+	}
+
+	int parse_repeat() {
+		int atom = parse_atom();
+		for (;;) {
+			int min, max;
+			if (accept('*')) {
+				min = 0, max = -1;
+			} else if (accept('+')) {
+				min = 1, max = -1;
+			} else if (accept('?')) {
+				min = 0, max = 1;
+			} else if (accept('{')) {
+				if (!parse_int(min)) {
+					error("invalid quantifier");
+				}
+				max = min;
+				if (accept(',')) {
+					if (!parse_int(max)) {
+						max = -1;
+					}
+				}
+				if (!accept('}') || (max >= 0 && max < min)) {
+					error("invalid quantifier");
+				}
+			} else {
+				return atom;
 			}
-			bpe_offsets.emplace_back(match.length());
-			start_idx = match.position() + match.length();
-			++it;
+			node rep{node::REPEAT};
+			rep.min	   = min;
+			rep.max	   = max;
+			rep.greedy = !accept('?');
+			rep.children.push_back(atom);
+			atom = add_node(std::move(rep));
 		}
+	}
 
-		if (start_idx < (int64_t)offset) {
-			bpe_offsets.emplace_back(offset - start_idx);
+	int parse_atom() {
+		const uint32_t c = pattern[pos++];
+		switch (c) {
+		case '(': {
+			int look = -1;
+			if (accept('?')) {
+				if (accept(':')) {
+					look = -1;
+				} else if (accept('=')) {
+					look = 0;
+				} else if (accept('!')) {
+					look = 1;
+				} else {
+					error("unsupported group");
+				}
+			}
+			int inner = parse_alt();
+			if (!accept(')')) {
+				error("missing ')'");
+			}
+			if (look < 0) {
+				return inner;
+			}
+			node n{node::LOOK};
+			n.value = look;
+			n.children.push_back(inner);
+			return add_node(std::move(n));
+		}
+		case '[':
+			return add_node({node::CLASS, (uint32_t)add_class(parse_class())});
+		case '.':
+			return add_node({node::ANY});
+		case '^':
+			return add_node({node::BOL});
+		case '$':
+			return add_node({node::EOL});
+		case '\\': {
+			unicode_regex_class cls;
+			uint32_t sym;
+			if (parse_escape(cls, sym, false)) {
+				return add_node({node::CLASS, (uint32_t)add_class(cls)});
+			}
+			return add_node({node::SYM, sym});
+		}
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			error("nothing to repeat");
+		default:
+			return add_node({node::SYM, c});
 		}
-		start += offset;
 	}
 
-	return bpe_offsets;
+	// \s, \d, \w classify ASCII only, as in the "C" locale std::regex uses
+	static unicode_regex_class escape_class(uint32_t c) {
+		unicode_regex_class cls;
+		switch (c) {
+		case 's':
+			cls.add('\t', '\r');
+			cls.add(' ', ' ');
+			break;
+		case 'd':
+			cls.add('0', '9');
+			break;
+		case 'w':
+			cls.add('0', '9');
+			cls.add('A', 'Z');
+			cls.add('a', 'z');
+			cls.add('_', '_');
+			break;
+		}
+		return cls;
+	}
+
+	uint32_t parse_hex(int n_digits) {
+		uint32_t value = 0;
+		for (int i = 0; i < n_digits; ++i) {
+			if (at_end()) {
+				error("invalid escape");
+			}
+			const uint32_t c = pattern[pos++];
+			if ('0' <= c && c <= '9') {
+				value = value * 16 + (c - '0');
+			} else if ('a' <= c && c <= 'f') {
+				value = value * 16 + (c - 'a' + 10);
+			} else if ('A' <= c && c <= 'F') {
+				value = value * 16 + (c - 'A' + 10);
+			} else {
+				error("invalid escape");
+			}
+		}
+		return value;
+	}
+
+	// parses the escape after '\', returns true and sets cls for a class
+	// escape, returns false and sets sym for a single symbol
+	bool parse_escape(unicode_regex_class &cls, uint32_t &sym, bool in_class) {
+		if (at_end()) {
+			error("trailing '\\'");
+		}
+		const uint32_t c = pattern[pos++];
+		switch (c) {
+		case 's':
+		case 'd':
+		case 'w':
+			cls = escape_class(c);
+			return true;
+		case 'S':
+		case 'D':
+		case 'W':
+			cls = unicode_regex_class();
+			cls.add_complement(escape_class(c - 'A' + 'a'));
+			return true;
+		case 'f':
+			sym = '\f';
+			return false;
+		case 'n':
+			sym = '\n';
+			return false;
+		case 'r':
+			sym = '\r';
+			return false;
+		case 't':
+			sym = '\t';
+			return false;
+		case 'v':
+			sym = '\v';
+			return false;
+		case '0':
+			sym = 0;
+			return false;
+		case 'x':
+			sym = parse_hex(2);
+			return false;
+		case 'u':
+			sym = parse_hex(4);
+			return false;
+		case 'b':
+			if (in_class) {
+				sym = '\b';
+				return false;
+			}
+			error("word boundaries are not supported");
+		default:
+			if (('1' <= c && c <= '9') || c == 'B' || c == 'c') {
+				error("unsupported escape");
+			}
+			sym = c;
+			return false;
+		}
+	}
+
+	// parses a bracket expression after '['
+	unicode_regex_class parse_class() {
+		unicode_regex_class cls;
+		cls.negated = accept('^');
+		// in ECMAScript a ']' always closes the class, "[]" matches nothing
+		while (!accept(']')) {
+			if (at_end()) {
+				error("missing ']'");
+			}
+
+			unicode_regex_class esc;
+			uint32_t lo;
+			if (accept('\\')) {
+				if (parse_escape(esc, lo, true)) {
+					cls.add(esc);
+					continue;
+				}
+			} else {
+				lo = pattern[pos++];
+			}
+
+			// a '-' right before the closing ']' is a literal
+			if (pos + 1 < pattern.size() && peek() == '-' &&
+				pattern[pos + 1] != ']') {
+				pos++;
+				uint32_t hi;
+				if (accept('\\')) {
+					if (parse_escape(esc, hi, true)) {
+						error("invalid range");
+					}
+				} else {
+					hi = pattern[pos++];
+				}
+				if (hi < lo) {
+					error("invalid range");
+				}
+				cls.add(lo, hi);
+			} else {
+				cls.add(lo, lo);
+			}
+		}
+		return cls;
+	}
+
+	bool nullable(int n) const {
+		const node &nd = nodes[n];
+		switch (nd.type) {
+		case node::SYM:
+		case node::CLASS:
+		case node::ANY:
+			return false;
+		case node::CAT:
+			for (int c : nd.children) {
+				if (!nullable(c)) {
+					return false;
+				}
+			}
+			return true;
+		case node::ALT:
+			for (int c : nd.children) {
+				if (nullable(c)) {
+					return true;
+				}
+			}
+			return false;
+		case node::REPEAT:
+			return nd.min == 0 || nullable(nd.children[0]);
+		default:
+			return true;
+		}
+	}
+
+	// adds the symbols node n can start with to set, returns nullable(n)
+	bool first_set(int n, unicode_regex_class &set) const {
+		const node &nd = nodes[n];
+		switch (nd.type) {
+		case node::SYM:
+			set.add(nd.value, nd.value);
+			return false;
+		case node::CLASS: {
+			const auto &cls = re.classes[nd.value];
+			if (cls.negated) {
+				unicode_regex_class positive = cls;
+				positive.negated			 = false;
+				set.add_complement(positive);
+			} else {
+				set.add(cls);
+			}
+			return false;
+		}
+		case node::ANY:
+			set.add(0, UNICODE_REGEX_SYM_MAX);
+			return false;
+		case node::CAT:
+			for (int c : nd.children) {
+				if (!first_set(c, set)) {
+					return false;
+				}
+			}
+			return true;
+		case node::ALT: {
+			bool any_nullable = false;
+			for (int c : nd.children) {
+				any_nullable |= first_set(c, set);
+			}
+			return any_nullable;
+		}
+		case node::REPEAT:
+			return first_set(nd.children[0], set) || nd.min == 0;
+		default:
+			// assertions do not consume, the symbols after them must match
+			return true;
+		}
+	}
+
+	int emit_inst(unicode_regex::op_type op, uint32_t arg = 0) {
+		re.code.push_back({op, arg});
+		return re.code.size() - 1;
+	}
+
+	// one iteration of a loop that may match the empty string fails if it
+	// does so, like the ECMAScript RepeatMatcher
+	void emit_iteration(int body) {
+		if (!nullable(body)) {
+			emit(body);
+			return;
+		}
+		const uint32_t reg = re.n_regs++;
+		emit_inst(unicode_regex::OP_MARK, reg);
+		emit(body);
+		emit_inst(unicode_regex::OP_PROGRESS, reg);
+	}
+
+	void emit(int n) {
+		const node &nd = nodes[n];
+		switch (nd.type) {
+		case node::EMPTY:
+			break;
+		case node::SYM:
+			emit_inst(unicode_regex::OP_SYM, nd.value);
+			break;
+		case node::CLASS:
+			emit_inst(unicode_regex::OP_CLASS, nd.value);
+			break;
+		case node::ANY:
+			emit_inst(unicode_regex::OP_ANY);
+			break;
+		case node::BOL:
+			emit_inst(unicode_regex::OP_BOL);
+			break;
+		case node::EOL:
+			emit_inst(unicode_regex::OP_EOL);
+			break;
+		case node::CAT:
+			for (int c : nd.children) {
+				emit(c);
+			}
+			break;
+		case node::ALT: {
+			std::vector<int> jumps;
+			for (size_t i = 0; i + 1 < nd.children.size(); ++i) {
+				const int split	  = emit_inst(unicode_regex::OP_SPLIT);
+				re.code[split].x = re.code.size();
+				emit(nd.children[i]);
+				jumps.push_back(emit_inst(unicode_regex::OP_JMP));
+				re.code[split].y = re.code.size();
+			}
+			emit(nd.children.back());
+			for (int j : jumps) {
+				re.code[j].x = re.code.size();
+			}
+		} break;
+		case node::REPEAT: {
+			const int body = nd.children[0];
+			for (int i = 0; i < nd.min; ++i) {
+				emit(body);
+			}
+			std::vector<int> splits;
+			if (nd.max < 0) {
+				const int split = emit_inst(unicode_regex::OP_SPLIT);
+				splits.push_back(split);
+				emit_iteration(body);
+				re.code[emit_inst(unicode_regex::OP_JMP)].x = split;
+			} else {
+				for (int i = nd.min; i < nd.max; ++i) {
+					splits.push_back(emit_inst(unicode_regex::OP_SPLIT));
+					emit_iteration(body);
+				}
+			}
+			const int end = re.code.size();
+			for (int s : splits) {
+				re.code[s].x = nd.greedy ? s + 1 : end;
+				re.code[s].y = nd.greedy ? end : s + 1;
+			}
+		} break;
+		case node::LOOK: {
+			const int look	 = emit_inst(unicode_regex::OP_LOOK, nd.value);
+			re.code[look].x = re.code.size();
+			emit(nd.children[0]);
+			emit_inst(unicode_regex::OP_MATCH);
+			re.code[look].y = re.code.size();
+		} break;
+		}
+	}
+
+	const std::vector<uint32_t> &pattern;
+	size_t pos = 0;
+	std::vector<node> nodes;
+	unicode_regex re;
+};
+
+// Runs a compiled regex over the symbols of one chunk. The backtrack stack
+// is kept between matches, so matching does not allocate once it has grown.
+struct unicode_regex_matcher {
+	explicit unicode_regex_matcher(const unicode_regex &re)
+		: re(re), regs(re.n_regs) {
+		stack.reserve(64);
+	}
+
+	// finds the first match starting at or after from, like std::regex_search
+	// with match_prev_avail set after the first search of a chunk
+	bool search(
+		const uint32_t *syms, size_t n, size_t from, bool continuous,
+		bool not_null, size_t &match_begin, size_t &match_end
+	) {
+		text	  = syms;
+		text_size = n;
+		for (size_t p = from; p <= n; ++p) {
+			if (!re.nullable && (p == n || !re.first.test(text[p]))) {
+				if (continuous) {
+					break;
+				}
+				continue;
+			}
+			reject = not_null ? p : SIZE_MAX;
+			if (run(0, p, match_end)) {
+				match_begin = p;
+				bol_ok		= false;
+				return true;
+			}
+			bol_ok = false;
+			if (continuous) {
+				break;
+			}
+		}
+		return false;
+	}
+
+	void reset_chunk() { bol_ok = true; }
+
+private:
+	struct frame {
+		int64_t pc; // < 0 for a saved register -(pc + 1)
+		size_t pos;
+	};
+
+	bool is_line_terminator(uint32_t c) const {
+		return c == '\n' || c == '\r' ||
+			   (re.wide && (c == 0x2028 || c == 0x2029));
+	}
+
+	bool run(int64_t pc, size_t pos, size_t &end) {
+		const size_t base = stack.size();
+		for (;;) {
+			const auto &in = re.code[pc];
+			bool ok		   = true;
+			switch (in.op) {
+			case unicode_regex::OP_SYM:
+				ok = pos < text_size && text[pos] == in.arg;
+				pos++, pc++;
+				break;
+			case unicode_regex::OP_CLASS:
+				ok = pos < text_size && re.classes[in.arg].test(text[pos]);
+				pos++, pc++;
+				break;
+			case unicode_regex::OP_ANY:
+				ok = pos < text_size && !is_line_terminator(text[pos]);
+				pos++, pc++;
+				break;
+			case unicode_regex::OP_SPLIT:
+				stack.push_back({in.y, pos});
+				pc = in.x;
+				break;
+			case unicode_regex::OP_JMP:
+				pc = in.x;
+				break;
+			case unicode_regex::OP_BOL:
+				ok = pos == 0 && bol_ok;
+				pc++;
+				break;
+			case unicode_regex::OP_EOL:
+				ok = pos == text_size;
+				pc++;
+				break;
+			case unicode_regex::OP_LOOK: {
+				const size_t outer_reject = reject;
+				size_t look_end;
+				reject = SIZE_MAX;
+				ok	   = run(in.x, pos, look_end) != (in.arg != 0);
+				reject = outer_reject;
+				pc	   = in.y;
+			} break;
+			case unicode_regex::OP_MARK:
+				stack.push_back({-(int64_t)in.arg - 1, regs[in.arg]});
+				regs[in.arg] = pos;
+				pc++;
+				break;
+			case unicode_regex::OP_PROGRESS:
+				ok = regs[in.arg] != pos;
+				pc++;
+				break;
+			case unicode_regex::OP_MATCH:
+				if (pos != reject) {
+					end = pos;
+					stack.resize(base);
+					return true;
+				}
+				ok = false;
+				break;
+			}
+
+			if (ok) {
+				continue;
+			}
+			// backtrack, restoring the registers saved on the way
+			for (;;) {
+				if (stack.size() == base) {
+					return false;
+				}
+				const frame f = stack.back();
+				stack.pop_back();
+				if (f.pc < 0) {
+					regs[-(f.pc + 1)] = f.pos;
+					continue;
+				}
+				pc	= f.pc;
+				pos = f.pos;
+				break;
+			}
+		}
+	}
+
+	const unicode_regex &re;
+	std::vector<frame> stack;
+	std::vector<size_t> regs;
+	const uint32_t *text = nullptr;
+	size_t text_size	 = 0;
+	size_t reject		 = SIZE_MAX; // a match may not end here (match_not_null)
+	bool bol_ok			 = true;
+};
+
+// the compiled programs are cached, the vocab uses the same few patterns for
+// every tokenize call
+static const unicode_regex &unicode_regex_get(
+	const std::string &key, const std::vector<uint32_t> &pattern, bool wide
+) {
+	static std::mutex mutex;
+	static std::unordered_map<std::string, std::unique_ptr<unicode_regex>>
+		cache;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = cache.find(key);
+	if (it == cache.end()) {
+		auto re = std::make_unique<unicode_regex>(
+			unicode_regex_compiler(pattern, wide).compile()
+		);
+		it = cache.emplace(key, std::move(re)).first;
+	}
+	return *it->second;
 }
 
-// use std::regex to split the text
-static std::vector<size_t> unicode_regex_split_stl(
-	const std::string &text,
-	const std::string &regex_expr,
+// split every chunk at the matches of re, like iterating std::regex_iterator
+static std::vector<size_t> unicode_regex_split_vm(
+	const std::vector<uint32_t> &syms,
+	const unicode_regex &re,
 	const std::vector<size_t> &offsets
 ) {
-	std::regex expr(regex_expr);
+	unicode_regex_matcher matcher(re);
 	std::vector<size_t> bpe_offsets; // store the offset of each word
 	bpe_offsets.reserve(offsets.size()
 	); // Reserve memory for the approximate size
 	size_t start = 0;
 	for (auto offset : offsets) {
-		std::cregex_iterator it(
-			text.data() + start, text.data() + start + offset, expr
-		);
-		std::cregex_iterator end;
+		const uint32_t *chunk = syms.data() + start;
+		matcher.reset_chunk();
+
+		size_t match_begin, match_end;
+		size_t start_idx = 0;
+		bool found =
+			matcher.search(chunk, offset, 0, false, false, match_begin, match_end);
+		while (found) {
+			if (match_begin > start_idx) {
+				bpe_offsets.emplace_back(match_begin - start_idx);
+			}
+			bpe_offsets.emplace_back(match_end - match_begin);
+			start_idx = match_end;
 
-		int64_t start_idx = 0;
-		while (it != end) {
-			std::cmatch match = *it;
-			if (match.position() > start_idx) {
-				bpe_offsets.emplace_back(match.position() - start_idx);
+			if (match_end > match_begin) {
+				found = matcher.search(
+					chunk, offset, match_end, false, false, match_begin,
+					match_end
+				);
+			} else if (match_end == offset) {
+				break;
+			} else {
+				// after an empty match, look for a non-empty one at the same
+				// position before moving on
+				const size_t from = match_end;
+				found			  = matcher.search(
+					chunk, offset, from, true, true, match_begin, match_end
+				);
+				if (!found) {
+					found = matcher.search(
+						chunk, offset, from + 1, false, false, match_begin,
+						match_end
+					);
+				}
 			}
-			bpe_offsets.emplace_back(match.length());
-			start_idx = match.position() + match.length();
-			++it;
 		}
 
-		if (start_idx < (int64_t)offset) {
+		if (start_idx < offset) {
 			bpe_offsets.emplace_back(offset - start_idx);
 		}
 		start += offset;
@@ -594,7 +1357,8 @@ static std::vector<size_t> unicode_regex_split_stl(
 }
 
 static std::vector<size_t> unicode_regex_split_custom(
-	const std::string &text,
+	const std::vector<uint32_t> &cpts,
+	const std::vector<codepoint_flags> &cpt_flags,
 	const std::string &regex_expr,
 	const std::vector<size_t> &offsets
 ) {
@@ -602,7 +1366,7 @@ static std::vector<size_t> unicode_regex_split_custom(
 
 	if (regex_expr == "'s|'t|'re|'ve|'m|'ll|'d| ?\\p{L}+| ?\\p{N}+| "
 					  "?[^\\s\\p{L}\\p{N}]+|\\s+(?!\\S)") {
-		bpe_offsets = unicode_regex_split_custom_gpt2(text, offsets);
+		bpe_offsets = unicode_regex_split_custom_gpt2(cpts, cpt_flags, offsets);
 	} else if (regex_expr == "(?i:'s|'t|'re|'ve|'m|'ll|'d)|[^\\r\\n\\p{L}\\p{N}"
 							 "]?\\p{L}+|\\p{N}{1,3}| "
 							 "?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+("
@@ -613,7 +1377,7 @@ static std::vector<size_t> unicode_regex_split_custom(
 				   "?[^\\s\\p{L}\\p{N}]+[\\r\\n]*|\\s*[\\r\\n]+|\\s+(?!\\S)|"
 				   "\\s+") {
 
-		bpe_offsets = unicode_regex_split_custom_llama3(text, offsets);
+		bpe_offsets = unicode_regex_split_custom_llama3(cpts, cpt_flags, offsets);
 	}
 
 	return bpe_offsets;
@@ -673,19 +1437,137 @@ std::vector<uint32_t> unicode_cpts_normalize_nfd(
 	return result;
 }
 
-std::vector<uint32_t> unicode_cpts_from_utf8(const std::string &utf8) {
-	std::vector<uint32_t> result;
-	result.reserve(utf8.size());
+static const std::vector<codepoint_flags> &unicode_cpt_flags_table() {
+	static const auto cpt_flags = unicode_cpt_flags_array();
+	return cpt_flags;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define UNICODE_AVX2_DISPATCH
+// the ASCII run at utf8 + offset, 32 bytes per step. Built for AVX2 whatever
+// the build targets, and only called once the CPU reports AVX2
+__attribute__((target("avx2"))) static void unicode_ascii_run_avx2(
+	const char *utf8, size_t size, size_t &offset, size_t &n, uint32_t *cpts,
+	codepoint_flags *flags, const std::vector<codepoint_flags> &table
+) {
+	while (offset + 32 <= size) {
+		const __m256i v = _mm256_loadu_si256((const __m256i *)(utf8 + offset));
+		if (_mm256_movemask_epi8(v) != 0) {
+			break;
+		}
+		for (int i = 0; i < 4; ++i) {
+			const __m128i b =
+				_mm_loadl_epi64((const __m128i *)(utf8 + offset + 8 * i));
+			_mm256_storeu_si256(
+				(__m256i *)(cpts + n + 8 * i), _mm256_cvtepu8_epi32(b)
+			);
+		}
+		if (flags) {
+			for (int i = 0; i < 32; ++i) {
+				flags[n + i] = table[(uint8_t)utf8[offset + i]];
+			}
+		}
+		offset += 32;
+		n += 32;
+	}
+}
+#endif
+
+// ASCII runs are decoded 16 (SSE2, NEON) or, on CPUs that have it, 32 (AVX2)
+// bytes per step, any other byte goes through the scalar decoder, which also
+// validates it
+size_t unicode_cpts_from_utf8(
+	const char *utf8, size_t size, uint32_t *cpts, codepoint_flags *flags
+) {
+	static const codepoint_flags undef(codepoint_flags::UNDEFINED);
+	const auto &table = unicode_cpt_flags_table();
+#if defined(UNICODE_AVX2_DISPATCH)
+	static const bool has_avx2 =
+		(__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+#endif
+
 	size_t offset = 0;
-	while (offset < utf8.size()) {
-		result.push_back(unicode_cpt_from_utf8(utf8, offset));
+	size_t n	  = 0;
+	while (offset < size) {
+#if defined(UNICODE_AVX2_DISPATCH)
+		if (has_avx2) {
+			unicode_ascii_run_avx2(utf8, size, offset, n, cpts, flags, table);
+		}
+#endif
+#if defined(__SSE2__)
+		while (offset + 16 <= size) {
+			const __m128i v = _mm_loadu_si128((const __m128i *)(utf8 + offset));
+			if (_mm_movemask_epi8(v) != 0) {
+				break;
+			}
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i lo   = _mm_unpacklo_epi8(v, zero);
+			const __m128i hi   = _mm_unpackhi_epi8(v, zero);
+			_mm_storeu_si128(
+				(__m128i *)(cpts + n + 0), _mm_unpacklo_epi16(lo, zero)
+			);
+			_mm_storeu_si128(
+				(__m128i *)(cpts + n + 4), _mm_unpackhi_epi16(lo, zero)
+			);
+			_mm_storeu_si128(
+				(__m128i *)(cpts + n + 8), _mm_unpacklo_epi16(hi, zero)
+			);
+			_mm_storeu_si128(
+				(__m128i *)(cpts + n + 12), _mm_unpackhi_epi16(hi, zero)
+			);
+			if (flags) {
+				for (int i = 0; i < 16; ++i) {
+					flags[n + i] = table[(uint8_t)utf8[offset + i]];
+				}
+			}
+			offset += 16;
+			n += 16;
+		}
+#elif defined(__ARM_NEON)
+		while (offset + 16 <= size) {
+			const uint8x16_t v = vld1q_u8((const uint8_t *)(utf8 + offset));
+			if (vmaxvq_u8(v) >= 0x80) {
+				break;
+			}
+			const uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+			const uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+			vst1q_u32(cpts + n + 0, vmovl_u16(vget_low_u16(lo)));
+			vst1q_u32(cpts + n + 4, vmovl_u16(vget_high_u16(lo)));
+			vst1q_u32(cpts + n + 8, vmovl_u16(vget_low_u16(hi)));
+			vst1q_u32(cpts + n + 12, vmovl_u16(vget_high_u16(hi)));
+			if (flags) {
+				for (int i = 0; i < 16; ++i) {
+					flags[n + i] = table[(uint8_t)utf8[offset + i]];
+				}
+			}
+			offset += 16;
+			n += 16;
+		}
+#endif
+		if (offset >= size) {
+			break;
+		}
+		const uint32_t cpt = unicode_cpt_from_utf8(utf8, size, offset);
+		cpts[n]			   = cpt;
+		if (flags) {
+			flags[n] = cpt < table.size() ? table[cpt] : undef;
+		}
+		n++;
 	}
+	return n;
+}
+
+std::vector<uint32_t> unicode_cpts_from_utf8(const std::string &utf8) {
+	std::vector<uint32_t> result(utf8.size());
+	result.resize(
+		unicode_cpts_from_utf8(utf8.data(), utf8.size(), result.data(), nullptr)
+	);
 	return result;
 }
 
 codepoint_flags unicode_cpt_flags(const uint32_t cp) {
 	static const codepoint_flags undef(codepoint_flags::UNDEFINED);
-	static const auto cpt_flags = unicode_cpt_flags_array();
+	const auto &cpt_flags = unicode_cpt_flags_table();
 	return cp < cpt_flags.size() ? cpt_flags[cp] : undef;
 }
 
@@ -751,11 +1633,18 @@ std::vector<std::string> unicode_regex_split(
 		}
 	}
 
-	const auto cpts = unicode_cpts_from_utf8(text);
+	// decode the text once, the codepoints and their flags are shared by all the splitters
+	std::vector<uint32_t> cpts(text.size());
+	std::vector<codepoint_flags> cpt_flags(text.size());
+	const size_t n_cpts = unicode_cpts_from_utf8(
+		text.data(), text.size(), cpts.data(), cpt_flags.data()
+	);
+	cpts.resize(n_cpts);
+	cpt_flags.resize(n_cpts);
 
 	// generate a "collapsed" representation of the text, where all codepoints are replaced by a single byte
 	// ref: https://github.com/ggerganov/llama.cpp/pull/6920#issuecomment-2081479935
-	std::string text_collapsed;
+	std::vector<uint32_t> text_collapsed;
 	if (need_collapse) {
 		// collapse all unicode categories
 		text_collapsed.resize(cpts.size());
@@ -767,34 +1656,38 @@ std::vector<std::string> unicode_regex_split(
 				continue;
 			}
 
-			const auto flags = unicode_cpt_flags(cpts[i]);
+			const auto flags = cpt_flags[i];
 
 			if (flags.is_whitespace) {
-				//NOTE: C++ std::regex \s does not mach 0x85, Rust and Python regex does.
-				//text_collapsed[i] = (char) 0x85;  // <Next Line> as whitespace fallback
-				text_collapsed[i] =
-					(char)0x0B; // <vertical tab> as whitespace fallback
+				//NOTE: \s does not mach 0x85 as in C++ std::regex, Rust and Python regex does.
+				//text_collapsed[i] = 0x85;  // <Next Line> as whitespace fallback
+				text_collapsed[i] = 0x0B; // <vertical tab> as whitespace fallback
 			} else if (k_ucat_cpt.find(flags.category_flag()) !=
 					   k_ucat_cpt.end()) {
 				text_collapsed[i] = k_ucat_cpt.at(flags.category_flag());
 			} else {
-				text_collapsed[i] = (char)0xD0; // fallback
+				text_collapsed[i] = 0xD0; // fallback
 			}
 		}
 	}
 
+	// the codepoints, for the regexes without unicode categories
+	std::vector<uint32_t> text_wide;
+
 	std::vector<size_t> bpe_offsets = {cpts.size()};
 
 	for (auto &regex_expr : regex_exprs) {
 		// first, see if we have an efficient custom regex implementation
-		auto tmp = unicode_regex_split_custom(text, regex_expr, bpe_offsets);
+		auto tmp = unicode_regex_split_custom(
+			cpts, cpt_flags, regex_expr, bpe_offsets
+		);
 
 		if (!tmp.empty()) {
 			bpe_offsets = std::move(tmp);
 			continue;
 		}
 
-		// fallback to general-purpose std::regex / std::wregex
+		// fallback to the general-purpose regex engine
 		try {
 			// if a unicode category is used in the regex, we use the collapsed text and replace the unicode category
 			// with the corresponding collapsed representation
@@ -819,21 +1712,21 @@ std::vector<std::string> unicode_regex_split(
 				}
 
 				// generate a collapsed representation of the regex
-				std::string regex_expr_collapsed;
+				std::vector<uint32_t> regex_expr_collapsed;
 
 				// track if we are inside [], because nested [] are not allowed
 				bool inside = false;
 				for (size_t i = 0; i < regex_expr.size(); ++i) {
 					if (regex_expr[i] == '[' &&
 						(i == 0 || regex_expr[i - 1] != '\\')) {
-						regex_expr_collapsed += '[';
+						regex_expr_collapsed.push_back('[');
 						inside = true;
 						continue;
 					}
 
 					if (inside && regex_expr[i] == ']' &&
 						regex_expr[i - 1] != '\\') {
-						regex_expr_collapsed += ']';
+						regex_expr_collapsed.push_back(']');
 						inside = false;
 						continue;
 					}
@@ -844,48 +1737,50 @@ std::vector<std::string> unicode_regex_split(
 						const std::string pat = regex_expr.substr(i, 5);
 						if (k_ucat_enum.find(pat) != k_ucat_enum.end()) {
 							if (!inside) {
-								regex_expr_collapsed += '[';
+								regex_expr_collapsed.push_back('[');
+							}
+							regex_expr_collapsed.push_back(
+								k_ucat_cpt.at(k_ucat_enum.at(pat))
+							);
+							for (char c : k_ucat_map.at(k_ucat_enum.at(pat))) {
+								regex_expr_collapsed.push_back((uint8_t)c);
 							}
-							regex_expr_collapsed +=
-								k_ucat_cpt.at(k_ucat_enum.at(pat));
-							regex_expr_collapsed +=
-								k_ucat_map.at(k_ucat_enum.at(pat));
 							if (!inside) {
-								regex_expr_collapsed += ']';
+								regex_expr_collapsed.push_back(']');
 							}
 							i += 4;
 							continue;
 						}
 					}
 
-					regex_expr_collapsed += regex_expr[i];
+					regex_expr_collapsed.push_back((uint8_t)regex_expr[i]);
 				}
 
-				//printf("text_collapsed: %s\n", text_collapsed.c_str());
-				//printf("regex_expr_collapsed: %s\n", regex_expr_collapsed.c_str());
-				bpe_offsets = unicode_regex_split_stl(
-					text_collapsed, regex_expr_collapsed, bpe_offsets
+				const auto &re = unicode_regex_get(
+					"collapsed:" + regex_expr, regex_expr_collapsed, false
 				);
+				bpe_offsets =
+					unicode_regex_split_vm(text_collapsed, re, bpe_offsets);
 			} else {
-				// no unicode category used, we can use std::wregex directly
-				const std::wstring wregex_expr =
-					unicode_wstring_from_utf8(regex_expr);
-
-				// std::wregex \s does not mach non-ASCII whitespaces, using 0x0B as fallback
-				std::wstring wtext(cpts.begin(), cpts.end());
-				for (size_t i = 0; i < wtext.size(); ++i) {
-					if (wtext[i] > 0x7F &&
-						unicode_cpt_flags(wtext[i]).is_whitespace) {
-						wtext[i] = 0x0B;
+				// no unicode category used, match the codepoints directly
+				if (text_wide.empty()) {
+					// \s does not match non-ASCII whitespaces, using 0x0B as fallback
+					text_wide = cpts;
+					for (size_t i = 0; i < text_wide.size(); ++i) {
+						if (text_wide[i] > 0x7F &&
+							cpt_flags[i].is_whitespace) {
+							text_wide[i] = 0x0B;
+						}
 					}
 				}
 
-				//printf("text: %s\n", text.c_str());
-				//printf("regex_expr: %s\n", regex_expr.c_str());
-				bpe_offsets =
-					unicode_regex_split_stl(wtext, wregex_expr, bpe_offsets);
+				const auto &re = unicode_regex_get(
+					"wide:" + regex_expr, unicode_cpts_from_utf8(regex_expr),
+					true
+				);
+				bpe_offsets = unicode_regex_split_vm(text_wide, re, bpe_offsets);
 			}
-		} catch (std::regex_error &e) {
+		} catch (unicode_regex_error &e) {
 			fprintf(
 				stderr, "Failed to process regex: '%s'\n", regex_expr.c_str()
 			);
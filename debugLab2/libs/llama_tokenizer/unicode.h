@@ -53,6 +53,10 @@ size_t unicode_len_utf8(char src);
 std::string unicode_cpt_to_utf8(uint32_t cp);
 uint32_t unicode_cpt_from_utf8(const std::string &utf8, size_t &offset);
 std::vector<uint32_t> unicode_cpts_from_utf8(const std::string &utf8);
+// decodes size bytes into cpts and, if not null, their flags; both need room
+// for size entries. returns the number of codepoints, throws on invalid UTF-8
+size_t unicode_cpts_from_utf8(const char *utf8, size_t size, uint32_t *cpts,
+							  codepoint_flags *flags);
 
 std::vector<uint32_t>
 unicode_cpts_normalize_nfd(const std::vector<uint32_t> &cpts);
@@ -1,55 +1,215 @@
 #include "core.hpp"
 #include "ggml.h"
+#include "llamafile/sgemm.h"
+#include "unicode.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstdint>
+#include <exception>
+#include <stdexcept>
 #include <string>
+#include <thread>
 
 namespace sep {
 
 RunState::RunState(Config *config) : config(config) {
 
-	uint16_t kv_dim		= (config->dim * config->n_kv_heads) / config->n_heads;
-	uint16_t dim		= config->dim;
-	uint16_t hidden_dim = config->hidden_dim;
-	uint16_t n_layers	= config->n_layers;
-	uint16_t cache_size	= n_layers * config->seq_len * kv_dim;
-
-	// alloc Optensors' buffer
-	x           = new float[dim];
-	xb			= new float[dim];
-	xb2			= new float[dim];
-	hb			= new float[hidden_dim];
-	hb2			= new float[hidden_dim];
-	q			= new float[dim];
-	key_cache	= new float[n_layers * config->seq_len * kv_dim];
-	value_cache = new float[n_layers * config->seq_len * kv_dim];
-	att			= new float[config->n_heads * config->seq_len];
-	logits		= new float[config->vocab_size];
-}
-
-RunState::~RunState() {
-	delete[] x;
-	delete[] xb;
-	delete[] xb2;
-	delete[] hb;
-	delete[] hb2;
-	delete[] q;
-	delete[] key_cache;
-	delete[] value_cache;
-	delete[] att;
-	delete[] logits;
-}
-
-Transformer::Transformer(std::string filename) : filename(filename) {
+	size_t kv_dim	  = (config->dim * config->n_kv_heads) / config->n_heads;
+	size_t dim		  = config->dim;
+	size_t hidden_dim = config->hidden_dim;
+	size_t cache_size = (size_t)config->n_layers * config->seq_len * kv_dim;
+
+	// carve the Optensors' buffers out of one allocation, zeroed: the graph forward reads
+	// every position of the cache (masked out or not)
+	size_t n_floats = 4 * dim + 2 * hidden_dim + 2 * cache_size +
+					  (size_t)config->n_heads * config->seq_len + config->vocab_size;
+	buffer			= std::make_unique<PageBuffer>(n_floats * sizeof(float));
+
+	float *next = (float *)buffer->data();
+	auto take	= [&next](size_t n) {
+		float *p = next;
+		next += n;
+		return p;
+	};
+	x			= take(dim);
+	xb			= take(dim);
+	xb2			= take(dim);
+	hb			= take(hidden_dim);
+	hb2			= take(hidden_dim);
+	q			= take(dim);
+	key_cache	= take(cache_size);
+	value_cache = take(cache_size);
+	att			= take(config->n_heads * config->seq_len);
+	logits		= take(config->vocab_size);
+}
+
+RunState::~RunState() = default;
+
+Transformer::Transformer(std::string filename, bool use_mmap) : filename(filename) {
+	// huge pages, and locking without mmap, read the file into a PageBuffer of the mapping
+	const auto &memory = memory_options();
+	bool copy		   = memory.huge_pages != HugePages::NONE || (memory.lock && !use_mmap);
 	{
-		gguf_init_params params = {.no_alloc = false, .ctx = &ggml_ctx_};
+		// no_alloc only reads the header and the tensor index
+		gguf_init_params params = {.no_alloc = use_mmap || copy, .ctx = &ggml_ctx_};
 		gguf_ctx_				= gguf_init_from_file(filename.c_str(), params);
 		assert(gguf_ctx_ != nullptr);
 		assert(ggml_ctx_ != nullptr);
 	}
+	if (use_mmap || copy) {
+		mapping_ = std::make_unique<ModelMapping>(filename, copy);
+		map_tensors();
+	}
 	config = new Config(gguf_ctx_);
 	weight = new Weight(ggml_ctx_, config->n_layers);
 	state  = new RunState(config);
+	if (mapping_) {
+		mapping_->prefetch(tensor_regions());
+	}
+}
+
+void Transformer::map_tensors() {
+	size_t data_offset = gguf_get_data_offset(gguf_ctx_);
+	for (int64_t i = 0; i < gguf_get_n_tensors(gguf_ctx_); i++) {
+		const char *name = gguf_get_tensor_name(gguf_ctx_, i);
+		ggml_tensor *t	 = ggml_get_tensor(ggml_ctx_, name);
+		size_t offset	 = data_offset + gguf_get_tensor_offset(gguf_ctx_, i);
+		if (t == nullptr || offset + ggml_nbytes(t) > mapping_->size()) {
+			throw std::runtime_error(fmt::format("Tensor {} is out of the model file", name));
+		}
+		t->data = mapping_->data() + offset;
+	}
+}
+
+// the data of a tensor, or nothing if the model has no such tensor
+std::vector<Transformer::Region> Transformer::tensor_regions(const std::string &name) const {
+	if (ggml_tensor *t = ggml_get_tensor(ggml_ctx_, name.c_str())) {
+		return {{(const char *)t->data, ggml_nbytes(t)}};
+	}
+	return {};
+}
+
+// the tensors in the order forward() reads them
+std::vector<Transformer::Region> Transformer::tensor_regions() const {
+	std::vector<Region> regions = tensor_regions("token_embd.weight");
+	for (uint32_t L = 0; L < config->n_layers; L++) {
+		for (const char *name : {"attn_norm", "attn_q", "attn_k", "attn_v", "attn_output",
+								 "ffn_norm", "ffn_gate", "ffn_up", "ffn_down"}) {
+			auto layer = tensor_regions(fmt::format("blk.{}.{}.weight", L, name));
+			regions.insert(regions.end(), layer.begin(), layer.end());
+		}
+	}
+	for (const char *name : {"output_norm.weight", "output.weight"}) {
+		auto output = tensor_regions(name);
+		regions.insert(regions.end(), output.begin(), output.end());
+	}
+	return regions;
+}
+
+void Transformer::set_layer_window(uint32_t n) {
+	if (n > 0 && (mapping_ == nullptr || !mapping_->releasable())) {
+		throw std::invalid_argument(
+			"the layer window needs the model file to be mapped, without huge pages or mlock");
+	}
+	if (n > 0 && graph_ != nullptr) {
+		throw std::invalid_argument("the layer window does not work with the graph forward");
+	}
+	if (n > 0 && !quantized_.empty()) {
+		throw std::invalid_argument("the layer window does not work with quantized weights");
+	}
+	layer_window_ = n < config->n_layers ? n : 0;
+	layer_regions_.assign(config->n_layers, {});
+	if (layer_window_ == 0) {
+		return;
+	}
+
+	// the embeddings, norms and output stay resident, only the layers come and go
+	for (uint32_t L = 0; L < config->n_layers; L++) {
+		auto prefix = fmt::format("blk.{}.", L);
+		for (int64_t i = 0; i < gguf_get_n_tensors(gguf_ctx_); i++) {
+			std::string name = gguf_get_tensor_name(gguf_ctx_, i);
+			if (name.compare(0, prefix.size(), prefix) == 0) {
+				auto tensor = tensor_regions(name);
+				layer_regions_[L].insert(layer_regions_[L].end(), tensor.begin(), tensor.end());
+			}
+		}
+	}
+
+	// replaces the prefetch of the whole model started by the constructor
+	begin_layer(0);
+	for (uint32_t L = layer_window_; L < config->n_layers; L++) {
+		end_layer(L);
+	}
+}
+
+void Transformer::set_graph_threads(int n) {
+	if (n > 0 && layer_window_ != 0) {
+		throw std::invalid_argument("the graph forward does not work with a layer window");
+	}
+	if (n > 0 && !quantized_.empty()) {
+		throw std::invalid_argument("the graph forward does not work with quantized weights");
+	}
+	graph_.reset();
+	if (n > 0) {
+		graph_ = std::make_unique<GraphForward>(*this, n);
+	}
+}
+
+void Transformer::quantize(ggml_type type) {
+	if (type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) {
+		throw std::invalid_argument(
+			fmt::format("cannot quantize the weights to {}", ggml_type_name(type)));
+	}
+	if (layer_window_ != 0 || graph_ != nullptr) {
+		throw std::invalid_argument(
+			"quantized weights do not work with a layer window or the graph forward");
+	}
+	std::vector<std::string> names = {"output.weight"};
+	for (uint32_t L = 0; L < config->n_layers; L++) {
+		for (const char *name : {"attn_q", "attn_k", "attn_v", "attn_output", "ffn_gate",
+								 "ffn_up", "ffn_down"}) {
+			names.push_back(fmt::format("blk.{}.{}.weight", L, name));
+		}
+	}
+	for (const auto &name : names) {
+		ggml_tensor *t = ggml_get_tensor(ggml_ctx_, name.c_str());
+		// rows that do not split into whole blocks stay f32
+		if (t == nullptr || t->type != GGML_TYPE_F32 || t->ne[0] % ggml_blck_size(type) != 0) {
+			continue;
+		}
+		const float *w = (const float *)t->data;
+		auto &q		   = quantized_[w];
+		q.type		   = type;
+		q.data.resize(ggml_row_size(type, t->ne[0]) * t->ne[1]);
+		ggml_quantize_chunk(type, w, q.data.data(), 0, t->ne[1], t->ne[0], nullptr);
+		if (mapping_) {
+			// only the reference kernels read the f32 weights from now on
+			mapping_->release((const char *)t->data, ggml_nbytes(t));
+		}
+	}
+}
+
+void Transformer::begin_layer(uint32_t L) {
+	if (layer_window_ == 0) {
+		return;
+	}
+	// the layers that run next, wrapping around to the first ones for the next token
+	std::vector<Region> regions;
+	for (uint32_t i = 1; i < layer_window_; i++) {
+		const auto &layer = layer_regions_[(L + i) % config->n_layers];
+		regions.insert(regions.end(), layer.begin(), layer.end());
+	}
+	mapping_->prefetch(std::move(regions));
+}
+
+void Transformer::end_layer(uint32_t L) {
+	if (layer_window_ == 0) {
+		return;
+	}
+	for (auto [begin, len] : layer_regions_[L]) {
+		mapping_->release(begin, len);
+	}
 }
 
 Transformer::~Transformer() { 
@@ -60,7 +220,136 @@ Transformer::~Transformer() {
 	delete state;
 }
 
-void Transformer::multihead_attention(uint32_t pos, uint64_t loff, Config &p, RunState &s) {
+// W (d,n) @ X (n_tokens,n)^T -> xout (n_tokens,d) with the tinyBLAS sgemm, false for the
+// shapes and types it does not take. It only multiplies two or more columns, and pairing a
+// single x with a zero column would double the work of every decode step, so a single token
+// is left to matmul(), which reads the weights once as well.
+static bool sgemm_matmul(float *xout, const float *x, const float *w, int n, int d,
+						 int n_tokens) {
+	if (n_tokens < 2) {
+		return false;
+	}
+	return llamafile_sgemm(d, n_tokens, n, w, n, x, n, xout, d, 0, 1, GGML_TYPE_F32,
+						   GGML_TYPE_F32, GGML_TYPE_F32);
+}
+
+// W (d,n) @ X (n_tokens,n)^T -> xout (n_tokens,d) for quantized W. Every x is quantized
+// once to the int8 blocks of the weights' vec_dot_type (Q8_0 for Q8_0 and Q4_0), shared by all
+// the rows, and each row is a single integer dot product of ggml (maddubs on AVX2).
+static void quantized_matmul(float *xout, const float *x, ggml_type type, const uint8_t *w,
+							 int n, int d, int n_tokens) {
+	auto traits		= ggml_internal_get_type_traits(type);
+	auto x_traits	= ggml_internal_get_type_traits(traits.vec_dot_type);
+	size_t row_size = ggml_row_size(type, n);
+	thread_local std::vector<uint8_t> xq;
+	xq.resize(ggml_row_size(traits.vec_dot_type, n));
+	for (int t = 0; t < n_tokens; t++) {
+		x_traits.from_float(x + (size_t)t * n, xq.data(), n);
+		float *out = xout + (size_t)t * d;
+		int i;
+#pragma omp parallel for private(i)
+		for (i = 0; i < d; i++) {
+			traits.vec_dot(n, &out[i], 0, w + i * row_size, 0, xq.data(), 0, 1);
+		}
+	}
+}
+
+void Transformer::run_matmul(const RunState &s, const char *op, int L, float *xout, float *x,
+							 float *w, int n, int d, int n_tokens) {
+	if (deterministic) {
+		for (int t = 0; t < n_tokens; t++) {
+			ref_matmul(xout + (size_t)t * d, x + (size_t)t * n, w, n, d);
+		}
+	} else {
+		run_base_matmul(op, L, xout, x, w, n, d, n_tokens);
+	}
+
+	// the side product scale * B (A x) of every adapter that covers w, the scratch buffers
+	// only grow to the largest rank and output, so decoding does not allocate
+	thread_local std::vector<float> ax, bax;
+	for (const auto &[adapter, scale] : s.lora) {
+		const auto *m = adapter->find(w);
+		if (m == nullptr) {
+			continue;
+		}
+		float alpha = scale * adapter->scale(*m);
+		ax.resize(m->rank);
+		bax.resize(d);
+		for (int t = 0; t < n_tokens; t++) {
+			if (deterministic) {
+				ref_matmul(ax.data(), x + (size_t)t * n, m->a, n, m->rank);
+				ref_matmul(bax.data(), ax.data(), m->b, m->rank, d);
+			} else {
+				matmul(ax.data(), x + (size_t)t * n, m->a, n, m->rank);
+				matmul(bax.data(), ax.data(), m->b, m->rank, d);
+			}
+			float *out = xout + (size_t)t * d;
+			for (int i = 0; i < d; i++) {
+				out[i] += alpha * bax[i];
+			}
+		}
+	}
+}
+
+void Transformer::run_base_matmul(const char *op, int L, float *xout, float *x, float *w, int n,
+								  int d, int n_tokens) {
+	auto quantized = quantized_.find(w);
+	if (quantized != quantized_.end()) {
+		quantized_matmul(xout, x, quantized->second.type, quantized->second.data.data(), n, d,
+						 n_tokens);
+	} else if (backend != MatmulBackend::LLAMAFILE ||
+			   !sgemm_matmul(xout, x, w, n, d, n_tokens)) {
+		if (n_tokens == 1) {
+			matmul(xout, x, w, n, d);
+		} else {
+			matmul_batch(xout, x, w, n, d, n_tokens);
+		}
+	}
+	if (numerics) {
+		std::vector<float> ref(d);
+		for (int t = 0; t < n_tokens; t++) {
+			ref_matmul(ref.data(), x + (size_t)t * n, w, n, d);
+			numerics->compare(op, L, xout + (size_t)t * d, ref.data(), d);
+		}
+	}
+}
+
+void Transformer::run_rmsnorm(const char *op, int L, float *o, float *x, float *weight,
+							  int64_t size) {
+	if (deterministic) {
+		ref_rmsnorm(o, x, weight, size);
+		return;
+	}
+	// o may be x, keep the input for the reference
+	std::vector<float> ref;
+	if (numerics) {
+		ref.assign(x, x + size);
+	}
+	rmsnorm(o, x, weight, size);
+	if (numerics) {
+		ref_rmsnorm(ref.data(), ref.data(), weight, size);
+		numerics->compare(op, L, o, ref.data(), size);
+	}
+}
+
+void Transformer::run_softmax(const char *op, int L, float *x, int64_t size) {
+	if (deterministic) {
+		ref_softmax(x, size);
+		return;
+	}
+	std::vector<float> ref;
+	if (numerics) {
+		ref.assign(x, x + size);
+	}
+	softmax(x, size);
+	if (numerics) {
+		ref_softmax(ref.data(), size);
+		numerics->compare(op, L, x, ref.data(), size);
+	}
+}
+
+void Transformer::multihead_attention(uint32_t pos, int L, uint64_t loff, Config &p,
+									  RunState &s) {
 
 	auto dim	   = p.dim;
 	auto kv_dim	   = (p.dim * p.n_kv_heads) / p.n_heads;
@@ -84,7 +373,7 @@ void Transformer::multihead_attention(uint32_t pos, uint64_t loff, Config &p, Ru
 			att[t] = score;
 		}
 
-		softmax(att, pos + 1);
+		run_softmax("attn_softmax", L, att, pos + 1);
 
 		auto xb = s.xb + h * head_size;
 		memset(xb, 0, head_size * sizeof(float));
@@ -100,29 +389,29 @@ void Transformer::multihead_attention(uint32_t pos, uint64_t loff, Config &p, Ru
 	}
 }
 
-void Transformer::attention(int pos, int L) {
+void Transformer::attention(int pos, int L, RunState &rs) {
 	auto p = config;
-	auto s = state;
+	auto s = &rs;
 
 	auto w = weight;
 
 	auto kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
 
-	rmsnorm(s->xb, s->x, w->lw[L].attn_norm, p->dim);
+	run_rmsnorm("attn_norm", L, s->xb, s->x, w->lw[L].attn_norm, p->dim);
 
 	uint64_t loff = L * p->seq_len * kv_dim;
 	s->k		  = s->key_cache + loff + pos * kv_dim;
 	s->v		  = s->value_cache + loff + pos * kv_dim;
 	// QKV
-	matmul(s->q, s->xb, w->lw[L].attn_q, p->dim, p->dim);
-	matmul(s->k, s->xb, w->lw[L].attn_k, p->dim, kv_dim);
-	matmul(s->v, s->xb, w->lw[L].attn_v, p->dim, kv_dim);
+	run_matmul(*s, "attn_q", L, s->q, s->xb, w->lw[L].attn_q, p->dim, p->dim);
+	run_matmul(*s, "attn_k", L, s->k, s->xb, w->lw[L].attn_k, p->dim, kv_dim);
+	run_matmul(*s, "attn_v", L, s->v, s->xb, w->lw[L].attn_v, p->dim, kv_dim);
 	// position embedding
 	rope(pos, p, s);
 
-	multihead_attention(pos, loff, *p, *s);
+	multihead_attention(pos, L, loff, *p, *s);
 
-	matmul(s->xb2, s->xb, w->lw[L].attn_output, p->dim, p->dim);
+	run_matmul(*s, "attn_output", L, s->xb2, s->xb, w->lw[L].attn_output, p->dim, p->dim);
 
 	// residual connection
 	for (auto i = 0; i < p->dim; i++) {
@@ -132,16 +421,16 @@ void Transformer::attention(int pos, int L) {
 
 }
 
-void Transformer::ffn(int L) {
+void Transformer::ffn(int L, RunState &rs) {
 	auto p = config;
 	auto w = weight;
-	auto s = state;
+	auto s = &rs;
 
-	rmsnorm(s->xb, s->x, w->lw[L].ffn_norm, p->dim);
+	run_rmsnorm("ffn_norm", L, s->xb, s->x, w->lw[L].ffn_norm, p->dim);
 
 	// ffn_gate and ffn_up
-	matmul(s->hb, s->xb, w->lw[L].ffn_gate, p->dim, p->hidden_dim);
-	matmul(s->hb2, s->xb, w->lw[L].ffn_up, p->dim, p->hidden_dim);
+	run_matmul(*s, "ffn_gate", L, s->hb, s->xb, w->lw[L].ffn_gate, p->dim, p->hidden_dim);
+	run_matmul(*s, "ffn_up", L, s->hb2, s->xb, w->lw[L].ffn_up, p->dim, p->hidden_dim);
 
 	for (auto i = 0; i < p->hidden_dim; i++) {
 		float val = s->hb[i];
@@ -152,7 +441,7 @@ void Transformer::ffn(int L) {
 		s->hb[i] = val;
 	}
 	// ffn_down
-	matmul(s->xb, s->hb, w->lw[L].ffn_down, p->hidden_dim, p->dim);
+	run_matmul(*s, "ffn_down", L, s->xb, s->hb, w->lw[L].ffn_down, p->hidden_dim, p->dim);
 
 	// residual connection
 	for (int i = 0; i < p->dim; i++) {
@@ -166,6 +455,105 @@ float *Transformer::forward(int token, int pos) {
 	auto s = state;
 	float *logits = s->logits;
 
+	// the graph only holds the base weights
+	if (graph_ != nullptr && s->lora.empty()) {
+		if (numerics == nullptr) {
+			return graph_->forward(*s, token, pos);
+		}
+		// the hand-written step first, the graph overwrites its keys / values at pos
+		forward_hidden(token, pos, *s);
+		run_matmul(*s, "output", -1, logits, s->x, w->output_weight, p->dim, p->vocab_size);
+		std::vector<float> ref(logits, logits + p->vocab_size);
+		graph_->forward(*s, token, pos);
+		numerics->compare("graph_logits", -1, logits, ref.data(), p->vocab_size);
+		return logits;
+	}
+
+	forward_hidden(token, pos, *s);
+
+	run_matmul(*s, "output", -1, logits, s->x, w->output_weight, p->dim, p->vocab_size);
+
+	return logits;
+}
+
+float *Transformer::forward_batch(const std::vector<int> &tokens, int pos) {
+	auto p = config;
+	auto w = weight;
+	auto s = state;
+
+	int n		= tokens.size();
+	auto dim	= p->dim;
+	auto kv_dim = (p->dim * p->n_kv_heads) / p->n_heads;
+	auto hidden = p->hidden_dim;
+	// one row per token, the RunState buffers hold the row of the token in attention
+	std::vector<float> x(n * dim), xb(n * dim), xb2(n * dim), q(n * dim);
+	std::vector<float> hb(n * hidden), hb2(n * hidden);
+
+	for (int t = 0; t < n; t++) {
+		memcpy(&x[t * dim], w->token_embedding_table + tokens[t] * dim, dim * sizeof(float));
+	}
+
+	for (auto L = 0; L < p->n_layers; L++) {
+		begin_layer(L);
+		auto &lw	  = w->lw[L];
+		uint64_t loff = L * p->seq_len * kv_dim;
+
+		// attention, the keys / values go straight to their rows of the kv cache
+		float *k = s->key_cache + loff + pos * kv_dim;
+		float *v = s->value_cache + loff + pos * kv_dim;
+		for (int t = 0; t < n; t++) {
+			run_rmsnorm("attn_norm", L, &xb[t * dim], &x[t * dim], lw.attn_norm, dim);
+		}
+		run_matmul(*s, "attn_q", L, q.data(), xb.data(), lw.attn_q, dim, dim, n);
+		run_matmul(*s, "attn_k", L, k, xb.data(), lw.attn_k, dim, kv_dim, n);
+		run_matmul(*s, "attn_v", L, v, xb.data(), lw.attn_v, dim, kv_dim, n);
+		for (int t = 0; t < n; t++) {
+			// a token only sees the cache up to its own position, the rows of the
+			// tokens after it are not read yet
+			memcpy(s->q, &q[t * dim], dim * sizeof(float));
+			s->k = k + t * kv_dim;
+			rope(pos + t, p, s);
+			multihead_attention(pos + t, L, loff, *p, *s);
+			memcpy(&xb[t * dim], s->xb, dim * sizeof(float));
+		}
+		run_matmul(*s, "attn_output", L, xb2.data(), xb.data(), lw.attn_output, dim, dim, n);
+		for (int i = 0; i < n * dim; i++) {
+			x[i] += xb2[i];
+		}
+
+		// ffn
+		for (int t = 0; t < n; t++) {
+			run_rmsnorm("ffn_norm", L, &xb[t * dim], &x[t * dim], lw.ffn_norm, dim);
+		}
+		run_matmul(*s, "ffn_gate", L, hb.data(), xb.data(), lw.ffn_gate, dim, hidden, n);
+		run_matmul(*s, "ffn_up", L, hb2.data(), xb.data(), lw.ffn_up, dim, hidden, n);
+		for (int i = 0; i < n * hidden; i++) {
+			float val = hb[i];
+			val *= (1.0f / (1.0f + expf(-val)));
+			val *= hb2[i];
+			hb[i] = val;
+		}
+		run_matmul(*s, "ffn_down", L, xb.data(), hb.data(), lw.ffn_down, hidden, dim, n);
+		for (int i = 0; i < n * dim; i++) {
+			x[i] += xb[i];
+		}
+		end_layer(L);
+	}
+
+	for (int t = 0; t < n; t++) {
+		run_rmsnorm("output_norm", -1, &x[t * dim], &x[t * dim], w->rms_final_weight, dim);
+	}
+	batch_logits_.resize((size_t)n * p->vocab_size);
+	run_matmul(*s, "output", -1, batch_logits_.data(), x.data(), w->output_weight, dim,
+			   p->vocab_size, n);
+	return batch_logits_.data();
+}
+
+void Transformer::forward_hidden(int token, int pos, RunState &rs) {
+	auto p = config;
+	auto w = weight;
+	auto s = &rs;
+
 	auto dim = p->dim;
 
 	// 1. input embedding
@@ -173,62 +561,302 @@ float *Transformer::forward(int token, int pos) {
 	memcpy(s->x, content_row, dim * sizeof(float));
 
 	for (auto L = 0; L < p->n_layers; L++) {
+		begin_layer(L);
 		// 2. attention
-		attention(pos, L);
+		attention(pos, L, *s);
 		// 3. ffn
-		ffn(L);
+		ffn(L, *s);
+		end_layer(L);
 	}
 
-	rmsnorm(s->x, s->x, w->rms_final_weight, dim);
+	run_rmsnorm("output_norm", -1, s->x, s->x, w->rms_final_weight, dim);
+}
 
-	matmul(logits, s->x, w->output_weight, dim, p->vocab_size);
+std::vector<float> Transformer::embed(const std::vector<int> &tokens, Pooling pooling,
+									  RunState &s) {
+	auto dim = config->dim;
+	if (tokens.empty() || tokens.size() > config->seq_len) {
+		throw std::invalid_argument(fmt::format("expected 1 to {} tokens to embed, got {}",
+												config->seq_len, tokens.size()));
+	}
 
-	return logits;
+	// the kv cache of s is overwritten from position 0
+	std::vector<float> out(dim, 0.0f);
+	for (size_t pos = 0; pos < tokens.size(); pos++) {
+		forward_hidden(tokens[pos], pos, s);
+		if (pooling == Pooling::MEAN) {
+			for (uint32_t i = 0; i < dim; i++) {
+				out[i] += s.x[i];
+			}
+		}
+	}
+	if (pooling == Pooling::LAST) {
+		memcpy(out.data(), s.x, dim * sizeof(float));
+	}
+
+	// L2 normalize, the mean pooling's 1 / n cancels out
+	float ss = 0.0f;
+	for (auto v : out) {
+		ss += v * v;
+	}
+	float scale = ss > 0.0f ? 1.0f / sqrtf(ss) : 0.0f;
+	for (auto &v : out) {
+		v *= scale;
+	}
+	return out;
+}
+
+std::vector<std::vector<float>> Transformer::embed(const std::vector<std::vector<int>> &inputs,
+												   Pooling pooling, int n_threads) {
+	std::vector<std::vector<float>> out(inputs.size());
+	// begin_layer() / end_layer() drive a single prefetcher, so with a layer window the inputs
+	// go through one at a time
+	size_t n_workers = layer_window_ != 0 ? 1 : std::max(1, n_threads);
+	n_workers		 = std::min(n_workers, inputs.size());
+
+	// inputs are handed out one by one, so that long and short ones even out across the workers
+	std::atomic<size_t> next{0};
+	std::vector<std::exception_ptr> errors(n_workers);
+	auto worker = [&](size_t id) {
+		// every worker has its own activations and kv cache, the weights are shared read-only
+		RunState s(config);
+		s.lora = state->lora;
+		try {
+			for (size_t i; (i = next.fetch_add(1)) < inputs.size();) {
+				out[i] = embed(inputs[i], pooling, s);
+			}
+		} catch (...) {
+			errors[id] = std::current_exception();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (size_t id = 1; id < n_workers; id++) {
+		threads.emplace_back(worker, id);
+	}
+	if (n_workers > 0) {
+		worker(0);
+	}
+	for (auto &t : threads) {
+		t.join();
+	}
+	for (auto &e : errors) {
+		if (e) {
+			std::rethrow_exception(e);
+		}
+	}
+	return out;
+}
+
+std::string_view Detokenizer::push(Tokenizer::Token token) {
+	// only the held back bytes are kept, so the buffer stops growing after a few tokens
+	buffer.erase(0, buffer.size() - n_pending);
+	buffer.append(tk->piece(token));
+
+	// find the lead byte of the last sequence and hold it back if it is cut short
+	size_t n_complete = buffer.size();
+	for (size_t i = 1; i <= std::min<size_t>(4, buffer.size()); i++) {
+		char c = buffer[buffer.size() - i];
+		if ((c & 0xc0) == 0x80) {
+			continue;
+		}
+		if (unicode_len_utf8(c) > i) {
+			n_complete = buffer.size() - i;
+		}
+		break;
+	}
+	n_pending = buffer.size() - n_complete;
+	return std::string_view(buffer.data(), n_complete);
+}
+
+std::string_view Detokenizer::flush() {
+	std::string_view rest(buffer.data() + buffer.size() - n_pending, n_pending);
+	n_pending = 0;
+	return rest;
+}
+
+StopMatcher::StopMatcher(std::vector<std::string> stops) : stops(std::move(stops)) {
+	this->stops.erase(std::remove(this->stops.begin(), this->stops.end(), ""), this->stops.end());
+}
+
+std::string_view StopMatcher::push(std::string_view text) {
+	if (stopped_) {
+		return {};
+	}
+	buffer.erase(0, buffer.size() - n_held);
+	buffer.append(text);
+
+	size_t found = std::string::npos;
+	for (const auto &stop : stops) {
+		found = std::min(found, buffer.find(stop));
+	}
+	if (found != std::string::npos) {
+		stopped_ = true;
+		n_held	 = 0;
+		return std::string_view(buffer.data(), found);
+	}
+
+	// hold back the longest tail that is the start of a stop string
+	n_held = 0;
+	for (const auto &stop : stops) {
+		for (size_t n = std::min(stop.size(), buffer.size() + 1) - 1; n > n_held; n--) {
+			if (buffer.compare(buffer.size() - n, n, stop, 0, n) == 0) {
+				n_held = n;
+				break;
+			}
+		}
+	}
+	return std::string_view(buffer.data(), buffer.size() - n_held);
+}
+
+std::string_view StopMatcher::flush() {
+	std::string_view rest(buffer.data() + buffer.size() - n_held, n_held);
+	n_held = 0;
+	return rest;
 }
 
 void Transformer::generate(Tokenizer *tk, Sampler *sampler, std::string prompt, int steps) {
 	// encode the (string) prompt into tokens sequence
-	int num_prompt_tokens = 0;
-	auto prompt_tokens	  = tk->tokenize(prompt, true);
-	num_prompt_tokens	  = prompt_tokens.size();
+	auto prompt_tokens = tk->tokenize(prompt, true);
 
-	if (num_prompt_tokens < 1) {
+	if (prompt_tokens.size() < 1) {
 		fmt::println(stderr, "something is wrong, expected at least 1 prompt token\n");
 		exit(EXIT_FAILURE);
 	}
+
+	Detokenizer detokenizer(tk);
+	StopMatcher stop(stop_strings);
+	int n_forced = prompt_tokens.size() - 1; // the prompt is echoed, not matched
+	generate(tk, sampler, prompt_tokens, steps, [&](int token) {
+		// print the token as string, decode it with the Tokenizer object
+		auto text = detokenizer.push(token);
+		if (n_forced > 0) {
+			n_forced--;
+		} else {
+			text = stop.push(text);
+		}
+		fmt::print("{}", text);
+		fflush(stdout);
+		return !stop.stopped();
+	});
+	std::string rest(stop.push(detokenizer.flush()));
+	rest += stop.flush();
+	fmt::println("{}", rest);
+}
+
+// The tokens that followed the latest earlier occurrence of the last n tokens of the context
+// (history followed by token), trying n = max_ngram first and down to 1. Empty if none of
+// them occurs before. A continuation that runs into the end of the context goes on with the
+// draft itself, so a repeating span is drafted in full.
+static std::vector<int> prompt_lookup(const std::vector<int> &history, int token, int max_ngram,
+									  int n_draft) {
+	// the context is searched in place, token stands for its element len - 1. An earlier
+	// occurrence ends at len - 2 at the latest, so it lies in history, as do the first
+	// n - 1 tokens of the ngram
+	const int len = history.size() + 1;
+	for (int n = std::min(max_ngram, len - 1); n >= 1 && n_draft > 0; n--) {
+		for (int i = len - n - 1; i >= 0; i--) {
+			// the last token first, it rules out most of the candidates
+			if (history[i + n - 1] != token ||
+				!std::equal(history.begin() + i, history.begin() + i + n - 1,
+							history.begin() + (len - n))) {
+				continue;
+			}
+			std::vector<int> draft;
+			for (int j = i + n; (int)draft.size() < n_draft; j++) {
+				if (j < len - 1) {
+					draft.push_back(history[j]);
+				} else {
+					draft.push_back(j == len - 1 ? token : draft[j - len]);
+				}
+			}
+			return draft;
+		}
+	}
+	return {};
+}
+
+void Transformer::generate(Tokenizer *tk, Sampler *sampler, const std::vector<int> &prompt_tokens,
+						   int steps, const std::function<bool(int)> &on_token) {
+	int num_prompt_tokens = prompt_tokens.size();
+
+	// reuse the kv cache of a restored session as far as it matches the prompt,
+	// the last prompt token is always forwarded to get the logits
+	int n_past = 0;
+	while (n_past < (int)state->tokens.size() && n_past < num_prompt_tokens - 1 &&
+		   state->tokens[n_past] == prompt_tokens[n_past]) {
+		n_past++;
+	}
+	state->tokens.resize(n_past);
+	sampler->reset();
+	for (int i = 1; i <= n_past; i++) {
+		if (!on_token(prompt_tokens[i])) {
+			return;
+		}
+	}
+
 	// start the main loop
-	int next;					   // will store the next token in the sequence
-	auto token = prompt_tokens[0]; // kick off with the first token in the prompt
-	int pos	   = 0;				   // position in the sequence
+	int next;							// will store the next token in the sequence
+	auto token = prompt_tokens[n_past]; // kick off with the first uncached token in the prompt
+	int pos	   = n_past;				// position in the sequence
 	while (pos < steps) {
 
+		// once sampling, a draft looked up in the context is checked in the same pass
+		std::vector<int> batch = {token};
+		if (lookup_draft > 0 && pos >= num_prompt_tokens - 1) {
+			auto draft = prompt_lookup(state->tokens, token, lookup_ngram,
+									   std::min(lookup_draft, steps - pos - 1));
+			batch.insert(batch.end(), draft.begin(), draft.end());
+			n_drafted += draft.size();
+		}
+
 		// forward the transformer to get logits for the next token
-		float *logits = forward(token, pos);
+		float *logits = batch.size() == 1 ? forward(token, pos) : forward_batch(batch, pos);
+		state->tokens.insert(state->tokens.end(), batch.begin(), batch.end());
+
+		int pos0	  = pos;
+		size_t n_used = 0; // batch tokens whose logits were used
+		bool stop	  = false;
+		while (n_used < batch.size()) {
+			float *token_logits = logits + n_used * config->vocab_size;
+			n_used++;
+
+			// advance the state machine
+			if (pos < num_prompt_tokens - 1) {
+				// if we are still processing the input prompt, force the next
+				// prompt token
+				next = prompt_tokens[pos + 1];
+			} else {
+				// otherwise sample the next token from the logits
+				next = sampler->sample(token_logits);
+				if (sampler->finished || llama_token_is_eog_impl(tk->vocab, next) ||
+					std::find(stop_tokens.begin(), stop_tokens.end(), next) != stop_tokens.end()) {
+					stop = true;
+					break;
+				}
+			}
+			pos++;
 
-		// advance the state machine
-		if (pos < num_prompt_tokens - 1) {
-			// if we are still processing the input prompt, force the next
-			// prompt token
-			next = prompt_tokens[pos + 1];
-		} else {
-			// otherwise sample the next token from the logits
-			next = sampler->sample(logits);
-		}
-		pos++;
+			// data-dependent terminating condition: the BOS token delimits
+			// sequences, and the caller may stop the generation early
+			if (next == tk->bos_token() || !on_token(next)) {
+				stop = true;
+				break;
+			}
 
-		// data-dependent terminating condition: the BOS token delimits
-		// sequences
-		if (next == tk->bos_token()) {
+			// a draft token the sampler agrees with is already forwarded
+			if (n_used == batch.size() || next != batch[n_used]) {
+				break;
+			}
+			n_accepted++;
+		}
+		// the kv cache rows of the rejected draft tokens are overwritten later
+		state->tokens.resize(pos0 + n_used);
+		if (stop) {
 			break;
 		}
-
-		// print the token as string, decode it with the Tokenizer object
-		auto piece = tk->to_string(next);
-		fmt::print("{}", piece);
-		fflush(stdout);
 		token = next;
 	}
-	fmt::println("");
 }
 
 } // namespace sep
@@ -2,11 +2,22 @@
 
 #include "fmt/format.h"
 #include "ggml.h"
+#include "grammar.hpp"
+#include "graph_forward.hpp"
 #include "llama-vocab.h"
+#include "lora.hpp"
+#include "model_mapping.hpp"
+#include "numerics.hpp"
+#include "page_buffer.hpp"
 #include "tools.hpp"
+#include "vocab_cache.hpp"
 #include <cassert>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 namespace sep {
 
@@ -47,8 +58,15 @@ struct RunState {
 	// kv cache
 	float *key_cache;	// (layer, seq_len, dim)
 	float *value_cache; // (layer, seq_len, dim)
+	// tokens whose keys / values are in the kv cache, tokens.size() is the next position
+	std::vector<int> tokens;
+
+	// LoRA adapters applied on top of the shared base weights, with their scales
+	std::vector<std::pair<const LoraAdapter *, float>> lora;
 
 	Config *config;
+	// all of the buffers above, backed per memory_options()
+	std::unique_ptr<PageBuffer> buffer;
 
 	RunState(Config *config);
 	RunState(const RunState &other) : RunState(other.config) {
@@ -65,6 +83,8 @@ struct RunState {
 		uint64_t key_cache_size = sizeof(float) * config->n_layers * config->seq_len * kv_dim;
 		memcpy(key_cache, other.key_cache, key_cache_size);
 		memcpy(value_cache, other.value_cache, key_cache_size);
+		tokens = other.tokens;
+		lora   = other.lora;
 	};
 	~RunState();
 };
@@ -116,13 +136,35 @@ struct Weight {
 
 struct Sampler {
 	int vocab_size;
+	// with a grammar only the tokens that keep the output a prefix of a match are sampled,
+	// and the end of text token once the output is a match
+	const RegexGrammar *grammar = nullptr;
+	int grammar_state			= 0;
+	bool finished				= false; // the grammar picked the end of text token
 
 	Sampler(int vocab_size) : vocab_size(vocab_size) {}
 	~Sampler() {}
 
+	// called at the start of every generation
+	void reset() {
+		grammar_state = grammar ? grammar->start() : 0;
+		finished	  = false;
+	}
+
 	int sample(float *logits) {
 		int next;
-		next = sample_argmax(logits, vocab_size);
+		if (grammar == nullptr) {
+			next = sample_argmax(logits, vocab_size);
+			return next;
+		}
+		next = sample_argmax_masked(logits, grammar->mask(grammar_state), grammar->n_words(),
+									vocab_size);
+		// nothing allowed only happens in a dead end of the vocab, end the output there
+		if (next < 0 || next == grammar->eos()) {
+			finished = true;
+			return grammar->eos();
+		}
+		grammar_state = grammar->advance(grammar_state, next);
 		return next;
 	}
 };
@@ -132,8 +174,14 @@ struct Tokenizer {
 	using Token = llama_vocab::id;
 
 	struct llama_vocab vocab;
+	int n_threads = 1; // large texts are tokenized in chunks on this many threads
+
+	// with a cache_path, the loaded vocab is kept in that file and reused by the next start
+	Tokenizer(std::string vocab_path, std::string cache_path = "") {
+		if (!cache_path.empty() && load_vocab_cache(cache_path, vocab_path, vocab)) {
+			return;
+		}
 
-	Tokenizer(std::string vocab_path) {
 		struct ggml_context *ctx	   = nullptr;
 		struct gguf_init_params params = {
 			.no_alloc = true,
@@ -145,15 +193,68 @@ struct Tokenizer {
 
 		llm_load_vocab(vocab, meta);
 
+		if (!cache_path.empty() &&
+			!save_vocab_cache(cache_path, vocab_path, gguf_get_data_offset(meta), vocab)) {
+			fmt::println(stderr, "warning: failed to write the vocab cache {}", cache_path);
+		}
+
 		gguf_free(meta);
 	}
 
 	size_t n_vocabs() const { return vocab.n_vocab; }
 	Token bos_token() const { return vocab.special_bos_id; }
 	std::vector<Token> tokenize(const std::string &text, bool add_special) const {
-		return llama_tokenize_internal(vocab, text, add_special, true);
+		return llama_tokenize_internal(vocab, text, add_special, true, n_threads);
 	}
 	std::string to_string(Token token) const { return llama_token_to_piece(vocab, token); }
+	// same text as to_string(), without copying it out of the vocab's piece cache
+	std::string_view piece(Token token) const { return vocab.cache_token_to_piece.at(token); }
+};
+
+// Turns a stream of tokens back into text. The pieces are appended to a buffer
+// that is reused across tokens, and a UTF-8 sequence split over several tokens
+// (byte fallback tokens of CJK text, for example) is held back until it is
+// complete, so every returned chunk ends on a codepoint boundary.
+struct Detokenizer {
+	explicit Detokenizer(const Tokenizer *tk) : tk(tk) {}
+
+	// returns the text completed by token, valid until the next call
+	std::string_view push(Tokenizer::Token token);
+	// returns the bytes still held back, at the end of the stream
+	std::string_view flush();
+
+  private:
+	const Tokenizer *tk;
+	std::string buffer;
+	size_t n_pending = 0; // bytes at the end of buffer not returned yet
+};
+
+// Cuts a stream of text before the first stop string. Only the tail of the text that a
+// stop string could still start with is held back, so a match is found with a search
+// over that tail and the new text, however long the output gets.
+struct StopMatcher {
+	// empty stop strings are ignored
+	explicit StopMatcher(std::vector<std::string> stops);
+
+	// returns the text that can no longer be part of a stop string, valid until the next
+	// call. Once a stop string is found, that is the text before it and stopped() is set
+	std::string_view push(std::string_view text);
+	// returns the text still held back, at the end of the stream
+	std::string_view flush();
+	bool stopped() const { return stopped_; }
+
+  private:
+	std::vector<std::string> stops;
+	std::string buffer;
+	size_t n_held = 0; // bytes at the end of buffer not returned yet
+	bool stopped_ = false;
+};
+
+// kernel for the weight matrix products of the forward pass
+enum class MatmulBackend {
+	NAIVE,	   // matmul() from tools.hpp
+	LLAMAFILE, // tinyBLAS sgemm vendored with ggml, NAIVE for single tokens and the shapes
+			   // it does not take
 };
 
 struct Transformer {
@@ -163,18 +264,114 @@ struct Transformer {
 	Weight *weight;
 	RunState *state;
 
-	Transformer(std::string filename);
+	// with use_mmap the tensors point into a mapping of the file and are paged in on first use
+	// (and by a background prefetch), otherwise the whole file is read up front. The weights
+	// and the RunState buffers are backed and locked per memory_options()
+	Transformer(std::string filename, bool use_mmap = true);
 	~Transformer();
 
-	void multihead_attention(uint32_t pos, uint64_t loff, Config &p, RunState &s);
-	void attention(int pos, int L);
-	void ffn(int L);
+	// L only labels the numerics records, loff is the offset of layer L in the kv cache
+	void multihead_attention(uint32_t pos, int L, uint64_t loff, Config &p, RunState &s);
+	void attention(int pos, int L, RunState &s);
+	void ffn(int L, RunState &s);
 	float *forward(int token, int pos);
+	// runs the layers and the final norm, leaving the hidden state in s.x without the
+	// projection to the vocab
+	void forward_hidden(int token, int pos, RunState &s);
+	// runs the tokens at positions pos, pos + 1, ... in one pass over the weights and returns
+	// their logits (tokens.size(), vocab_size), valid until the next call. Always uses the
+	// kernels in tools.hpp, also with the graph forward.
+	float *forward_batch(const std::vector<int> &tokens, int pos);
+
+	// Embeddings for retrieval: the final hidden state of the last token, or the mean
+	// over all tokens, L2 normalized. The vocab projection is skipped.
+	enum class Pooling { LAST, MEAN };
+	// uses (and overwrites) the kv cache of s
+	std::vector<float> embed(const std::vector<int> &tokens, Pooling pooling, RunState &s);
+	// embeds every input on n_threads threads, each with a RunState of its own
+	std::vector<std::vector<float>> embed(const std::vector<std::vector<int>> &inputs,
+										  Pooling pooling, int n_threads = 1);
+
+	// Prompt lookup decoding: while sampling, the last tokens are looked up in the context
+	// (up to lookup_ngram of them) and the tokens that followed are checked as a draft of up
+	// to lookup_draft tokens in one forward_batch(). Every draft token the sampler agrees with
+	// is kept, so the output stays the same. lookup_draft 0 disables it.
+	int lookup_ngram	= 3;
+	int lookup_draft	= 0;
+	uint64_t n_drafted	= 0; // draft tokens checked
+	uint64_t n_accepted = 0; // draft tokens kept
+
+	// Sampling ends before a BOS token, an end of generation token of the vocab (EOS, EOT, ...)
+	// or one of stop_tokens. generate() of a prompt string also ends before the first of
+	// stop_strings in the generated text.
+	std::vector<int> stop_tokens;
+	std::vector<std::string> stop_strings;
 
 	void generate(Tokenizer *tk, Sampler *sampler, std::string prompt, int steps);
+	// core generation loop: on_token receives every token after the first prompt token
+	// (forced prompt tokens included), returning false stops the generation
+	void generate(Tokenizer *tk, Sampler *sampler, const std::vector<int> &prompt_tokens, int steps,
+				  const std::function<bool(int)> &on_token);
+
+	// Out-of-core mode for models larger than RAM: only a window of n layers is kept
+	// resident. While a layer runs, the next n - 1 are prefetched in the background,
+	// and a layer is released as soon as it is done. 0 keeps all layers resident.
+	// Needs the mmap loader.
+	void set_layer_window(uint32_t n);
+
+	// Runs forward() as a ggml graph on ggml's CPU backend with n threads, 0 goes back to
+	// the kernels in tools.hpp. With numerics set, every step also runs the hand-written
+	// path and the logits of both are compared. Cannot be combined with a layer window,
+	// and embed() and states with LoRA adapters always use the hand-written path.
+	void set_graph_threads(int n);
+
+	// with numerics set, every kernel call is repeated with the reference kernel and the
+	// error is recorded there; deterministic runs the reference kernels only
+	NumericsChecker *numerics = nullptr;
+	bool deterministic		  = false;
+	MatmulBackend backend	  = MatmulBackend::NAIVE;
+
+	// Quantizes the weight matrices of the layers and the output to type (GGML_TYPE_Q8_0 or
+	// GGML_TYPE_Q4_0). Their matmuls then quantize the activation to the matching int8 blocks
+	// once and take integer dot products with ggml's kernels, for any backend. The reference
+	// kernels of deterministic and numerics keep using the f32 weights. The mapped f32 pages
+	// are released, so cannot be combined with a layer window or the graph forward.
+	void quantize(ggml_type type);
 
 	ggml_context *ggml_ctx_;
 	gguf_context *gguf_ctx_;
+	std::unique_ptr<ModelMapping> mapping_;
+	std::unique_ptr<GraphForward> graph_;
+
+  private:
+	using Region = std::pair<const char *, size_t>;
+
+	// a weight matrix quantized by quantize(), rows of ggml_row_size(type, n) bytes
+	struct QuantizedWeight {
+		ggml_type type;
+		std::vector<uint8_t> data;
+	};
+
+	// x and xout hold n_tokens rows, the LoRA adapters of s are added on top
+	void run_matmul(const RunState &s, const char *op, int L, float *xout, float *x, float *w,
+					int n, int d, int n_tokens = 1);
+	// the kernel of the base weights, quantized or per backend, and its numerics check
+	void run_base_matmul(const char *op, int L, float *xout, float *x, float *w, int n, int d,
+						 int n_tokens);
+	void run_rmsnorm(const char *op, int L, float *o, float *x, float *weight, int64_t size);
+	void run_softmax(const char *op, int L, float *x, int64_t size);
+
+	void map_tensors();
+	std::vector<Region> tensor_regions(const std::string &name) const;
+	std::vector<Region> tensor_regions() const;
+	void begin_layer(uint32_t L);
+	void end_layer(uint32_t L);
+
+	uint32_t layer_window_ = 0;
+	std::vector<std::vector<Region>> layer_regions_; // tensors of each layer
+	std::vector<float> batch_logits_;				 // returned by forward_batch()
+	// by the f32 weight they replace, empty unless quantize() ran
+	std::unordered_map<const float *, QuantizedWeight> quantized_;
 };
 
 static void rope(int pos, Config *p, RunState *s) {
@@ -0,0 +1,432 @@
+#include "grammar.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <bitset>
+#include <cctype>
+#include <map>
+#include <stdexcept>
+
+namespace sep {
+
+namespace {
+
+using ByteSet = std::bitset<256>;
+
+constexpr int MAX_REPEAT	= 1000;
+constexpr size_t MAX_STATES = 1 << 16;
+
+struct Node {
+	enum Kind { SET, CONCAT, ALT, REPEAT } kind;
+	ByteSet set{};			  // SET
+	std::vector<Node> kids{}; // CONCAT, ALT, REPEAT (one kid)
+	int min = 0, max = 0;	  // REPEAT, max -1 for unbounded
+};
+
+ByteSet byte_range(int first, int last) {
+	ByteSet set;
+	for (int c = first; c <= last; c++) {
+		set.set(c);
+	}
+	return set;
+}
+
+ByteSet class_digit() { return byte_range('0', '9'); }
+ByteSet class_word() {
+	return byte_range('a', 'z') | byte_range('A', 'Z') | byte_range('0', '9') |
+		   byte_range('_', '_');
+}
+ByteSet class_space() {
+	ByteSet set;
+	for (char c : std::string_view(" \t\n\r\f\v")) {
+		set.set((uint8_t)c);
+	}
+	return set;
+}
+
+// recursive descent over the pattern, one Node per construct
+class Parser {
+  public:
+	explicit Parser(const std::string &pattern) : s(pattern) {}
+
+	Node parse() {
+		Node node = alternation();
+		if (i != s.size()) {
+			fail("unbalanced ')'");
+		}
+		return node;
+	}
+
+  private:
+	[[noreturn]] void fail(const char *what) const {
+		throw std::invalid_argument(fmt::format("regex \"{}\" at {}: {}", s, i, what));
+	}
+
+	bool more() const { return i < s.size(); }
+	uint8_t peek() const { return s[i]; }
+
+	Node alternation() {
+		Node node{Node::ALT};
+		node.kids.push_back(concatenation());
+		while (more() && peek() == '|') {
+			i++;
+			node.kids.push_back(concatenation());
+		}
+		return node.kids.size() == 1 ? std::move(node.kids[0]) : node;
+	}
+
+	Node concatenation() {
+		Node node{Node::CONCAT};
+		while (more() && peek() != '|' && peek() != ')') {
+			node.kids.push_back(repetition());
+		}
+		return node;
+	}
+
+	Node repetition() {
+		Node node = atom();
+		while (more()) {
+			int min, max;
+			if (peek() == '*') {
+				min = 0, max = -1;
+			} else if (peek() == '+') {
+				min = 1, max = -1;
+			} else if (peek() == '?') {
+				min = 0, max = 1;
+			} else if (peek() == '{') {
+				i++;
+				min = number();
+				max = min;
+				if (more() && peek() == ',') {
+					i++;
+					max = more() && peek() == '}' ? -1 : number();
+				}
+				if (!more() || peek() != '}') {
+					fail("expected '}'");
+				}
+				if (max != -1 && max < min) {
+					fail("bad repetition range");
+				}
+			} else {
+				break;
+			}
+			i++;
+			Node repeat{Node::REPEAT};
+			repeat.min = min;
+			repeat.max = max;
+			repeat.kids.push_back(std::move(node));
+			node = std::move(repeat);
+		}
+		return node;
+	}
+
+	int number() {
+		int n = 0;
+		if (!more() || !isdigit(peek())) {
+			fail("expected a number");
+		}
+		while (more() && isdigit(peek())) {
+			n = n * 10 + (s[i++] - '0');
+			if (n > MAX_REPEAT) {
+				fail("repetition count too large");
+			}
+		}
+		return n;
+	}
+
+	Node atom() {
+		uint8_t c = s[i++];
+		Node node{Node::SET};
+		switch (c) {
+		case '(': {
+			node = alternation();
+			if (!more() || peek() != ')') {
+				fail("expected ')'");
+			}
+			i++;
+			return node;
+		}
+		case '[':
+			node.set = bracket();
+			return node;
+		case '.':
+			node.set = ~byte_range('\n', '\n');
+			return node;
+		case '\\':
+			node.set = escape();
+			return node;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+			fail("nothing to repeat");
+		case '^':
+		case '$':
+			fail("anchors are not supported, the whole output is matched");
+		default:
+			node.set.set(c);
+			return node;
+		}
+	}
+
+	ByteSet escape() {
+		if (!more()) {
+			fail("trailing '\\'");
+		}
+		uint8_t c = s[i++];
+		switch (c) {
+		case 'd':
+			return class_digit();
+		case 'D':
+			return ~class_digit();
+		case 'w':
+			return class_word();
+		case 'W':
+			return ~class_word();
+		case 's':
+			return class_space();
+		case 'S':
+			return ~class_space();
+		case 'n':
+			return byte_range('\n', '\n');
+		case 'r':
+			return byte_range('\r', '\r');
+		case 't':
+			return byte_range('\t', '\t');
+		default:
+			if (isalnum(c)) {
+				fail("unknown escape");
+			}
+			return byte_range(c, c);
+		}
+	}
+
+	ByteSet bracket() {
+		ByteSet set;
+		bool negate = more() && peek() == '^';
+		if (negate) {
+			i++;
+		}
+		// a ']' right after the '[' is a literal
+		bool first = true;
+		while (more() && (peek() != ']' || first)) {
+			first = false;
+			if (peek() == '\\') {
+				i++;
+				set |= escape();
+				continue;
+			}
+			uint8_t lo = s[i++];
+			if (i + 1 < s.size() && peek() == '-' && s[i + 1] != ']') {
+				uint8_t hi = s[i + 1];
+				if (hi < lo) {
+					fail("bad class range");
+				}
+				set |= byte_range(lo, hi);
+				i += 2;
+			} else {
+				set.set(lo);
+			}
+		}
+		if (!more()) {
+			fail("expected ']'");
+		}
+		i++;
+		return negate ? ~set : set;
+	}
+
+	const std::string &s;
+	size_t i = 0;
+};
+
+// Thompson NFA: every state has one byte edge or some epsilon edges
+struct Nfa {
+	struct State {
+		ByteSet set;
+		int next = -1;
+		std::vector<int> eps;
+	};
+	std::vector<State> states;
+
+	int add() {
+		if (states.size() >= MAX_STATES) {
+			throw std::invalid_argument("regex too large");
+		}
+		states.emplace_back();
+		return states.size() - 1;
+	}
+
+	// returns the (start, end) states of the node
+	std::pair<int, int> build(const Node &node) {
+		int start = add();
+		int end	  = add();
+		switch (node.kind) {
+		case Node::SET:
+			states[start].set  = node.set;
+			states[start].next = end;
+			break;
+		case Node::CONCAT: {
+			int last = start;
+			for (auto &kid : node.kids) {
+				auto [s, e] = build(kid);
+				states[last].eps.push_back(s);
+				last = e;
+			}
+			states[last].eps.push_back(end);
+			break;
+		}
+		case Node::ALT:
+			for (auto &kid : node.kids) {
+				auto [s, e] = build(kid);
+				states[start].eps.push_back(s);
+				states[e].eps.push_back(end);
+			}
+			break;
+		case Node::REPEAT: {
+			int last = start;
+			for (int k = 0; k < node.min; k++) {
+				auto [s, e] = build(node.kids[0]);
+				states[last].eps.push_back(s);
+				last = e;
+			}
+			if (node.max == -1) {
+				auto [s, e] = build(node.kids[0]);
+				states[last].eps.push_back(s);
+				states[e].eps.push_back(s);
+				states[e].eps.push_back(end);
+			} else {
+				// every optional copy may skip to the end
+				for (int k = node.min; k < node.max; k++) {
+					auto [s, e] = build(node.kids[0]);
+					states[last].eps.push_back(s);
+					states[last].eps.push_back(end);
+					last = e;
+				}
+			}
+			states[last].eps.push_back(end);
+			break;
+		}
+		}
+		return {start, end};
+	}
+
+	// adds the states reachable from set over epsilon edges, returns it sorted
+	std::vector<int> closure(std::vector<int> set) const {
+		std::vector<bool> seen(states.size());
+		for (int s : set) {
+			seen[s] = true;
+		}
+		for (size_t k = 0; k < set.size(); k++) {
+			for (int t : states[set[k]].eps) {
+				if (!seen[t]) {
+					seen[t] = true;
+					set.push_back(t);
+				}
+			}
+		}
+		std::sort(set.begin(), set.end());
+		return set;
+	}
+};
+
+} // namespace
+
+RegexGrammar::RegexGrammar(const std::string &pattern, const llama_vocab &vocab,
+						   int vocab_size)
+	: eos_(vocab.special_eos_id), vocab_(vocab) {
+	Node root = Parser(pattern).parse();
+	Nfa nfa;
+	auto [nfa_start, nfa_end] = nfa.build(root);
+
+	// subset construction, DFA state 0 is the start
+	std::map<std::vector<int>, int> ids;
+	std::vector<std::vector<int>> sets = {nfa.closure({nfa_start})};
+	ids[sets[0]]					   = 0;
+	for (size_t d = 0; d < sets.size(); d++) {
+		accepting_.push_back(std::binary_search(sets[d].begin(), sets[d].end(), nfa_end));
+		for (int c = 0; c < 256; c++) {
+			std::vector<int> moved;
+			for (int s : sets[d]) {
+				if (nfa.states[s].next >= 0 && nfa.states[s].set.test(c)) {
+					moved.push_back(nfa.states[s].next);
+				}
+			}
+			int target = -1;
+			if (!moved.empty()) {
+				auto closed		  = nfa.closure(std::move(moved));
+				auto [it, is_new] = ids.try_emplace(closed, sets.size());
+				if (is_new) {
+					if (sets.size() >= MAX_STATES) {
+						throw std::invalid_argument("regex too large");
+					}
+					sets.push_back(std::move(closed));
+				}
+				target = it->second;
+			}
+			next_.push_back(target);
+		}
+	}
+
+	// drop the edges into states from which no match can be completed, so that every
+	// state left is a proper prefix of a match
+	size_t n = sets.size();
+	std::vector<bool> live(accepting_);
+	for (bool changed = true; changed;) {
+		changed = false;
+		for (size_t d = 0; d < n; d++) {
+			for (int c = 0; c < 256 && !live[d]; c++) {
+				int t = next_[d * 256 + c];
+				if (t >= 0 && live[t]) {
+					live[d] = changed = true;
+				}
+			}
+		}
+	}
+	if (!live[0]) {
+		throw std::invalid_argument(fmt::format("regex \"{}\" matches nothing", pattern));
+	}
+	for (auto &t : next_) {
+		if (t >= 0 && !live[t]) {
+			t = -1;
+		}
+	}
+
+	// allowed tokens of every state, control tokens and pieces that consume nothing are
+	// never allowed
+	n_words_ = (std::max<size_t>(vocab.n_vocab, std::max(vocab_size, 0)) + 63) / 64;
+	masks_.assign(n * n_words_, 0);
+	for (Token t = 0; t < (Token)vocab.n_vocab; t++) {
+		auto attr = vocab.id_to_token[t].attr;
+		if (attr & (LLAMA_TOKEN_ATTR_CONTROL | LLAMA_TOKEN_ATTR_UNKNOWN) ||
+			vocab.cache_token_to_piece[t].empty()) {
+			continue;
+		}
+		for (size_t d = 0; d < n; d++) {
+			if (live[d] && step(d, vocab.cache_token_to_piece[t]) >= 0) {
+				masks_[d * n_words_ + t / 64] |= 1ull << (t % 64);
+			}
+		}
+	}
+	if (eos_ >= 0 && eos_ < (Token)vocab.n_vocab) {
+		for (size_t d = 0; d < n; d++) {
+			if (accepting_[d]) {
+				masks_[d * n_words_ + eos_ / 64] |= 1ull << (eos_ % 64);
+			}
+		}
+	}
+}
+
+int RegexGrammar::step(int state, std::string_view bytes) const {
+	for (char c : bytes) {
+		state = next_[state * 256 + (uint8_t)c];
+		if (state < 0) {
+			break;
+		}
+	}
+	return state;
+}
+
+int RegexGrammar::advance(int state, Token token) const {
+	return step(state, vocab_.cache_token_to_piece.at(token));
+}
+
+} // namespace sep
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "llama-vocab.h"
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace sep {
+
+// Constrains generation to the language of a regular expression. The pattern is
+// compiled to a DFA over bytes, and for every DFA state the tokens whose piece can
+// be consumed from that state (without leaving the set of prefixes of a match) are
+// precomputed as a bitmask over the vocab. The end of text token is allowed in the
+// states that complete a match.
+//
+// Supported syntax: literals, `.` (any byte but '\n'), [a-z] classes and [^...]
+// negations, the escapes \d \D \w \W \s \S \n \r \t and \ before punctuation,
+// groups, `|`, and the quantifiers * + ? {m} {m,} {m,n}. Matching is byte level:
+// a quantifier after a multi-byte UTF-8 literal repeats its last byte only.
+// The whole output has to match, there are no anchors.
+class RegexGrammar {
+  public:
+	using Token = llama_vocab::id;
+
+	// throws std::invalid_argument for a malformed or unsupported pattern, or one that
+	// matches nothing. vocab_size is the model's, the masks cover it and the vocab,
+	// whichever is larger, and the tokens the vocab does not have are never allowed
+	RegexGrammar(const std::string &pattern, const llama_vocab &vocab, int vocab_size);
+
+	int start() const { return 0; }
+	size_t n_states() const { return accepting_.size(); }
+	bool accepting(int state) const { return accepting_[state]; }
+	Token eos() const { return eos_; }
+
+	// the tokens allowed in state, bit t of word t / 64
+	const uint64_t *mask(int state) const { return masks_.data() + state * n_words_; }
+	// words per mask
+	size_t n_words() const { return n_words_; }
+	// the state after the piece of an allowed token
+	int advance(int state, Token token) const;
+
+  private:
+	int step(int state, std::string_view bytes) const; // -1 once it leaves the language
+
+	std::vector<int> next_; // (state, byte) -> state, -1 for no match
+	std::vector<bool> accepting_;
+	std::vector<uint64_t> masks_;
+	size_t n_words_ = 0;
+	Token eos_;
+	const llama_vocab &vocab_;
+};
+
+} // namespace sep
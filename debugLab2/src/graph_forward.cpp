@@ -0,0 +1,146 @@
+#include "graph_forward.hpp"
+#include "core.hpp"
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+namespace sep {
+
+static ggml_tensor *model_tensor(const Transformer &transformer, const std::string &name) {
+	ggml_tensor *t = ggml_get_tensor(transformer.ggml_ctx_, name.c_str());
+	if (t == nullptr || t->type != GGML_TYPE_F32) {
+		throw std::runtime_error(fmt::format("Missing f32 tensor: {}", name));
+	}
+	return t;
+}
+
+GraphForward::GraphForward(const Transformer &transformer, int n_threads)
+	: config_(*transformer.config) {
+	const auto &p	= config_;
+	auto head_size	= p.dim / p.n_heads;
+	auto kv_dim		= (p.dim * p.n_kv_heads) / p.n_heads;
+	auto graph_size = 64 * p.n_layers + 64;
+
+	// only tensor metadata lives in the context, the allocator places the data
+	ggml_init_params params = {
+		.mem_size	= ggml_tensor_overhead() * graph_size +
+					  ggml_graph_overhead_custom(graph_size, false),
+		.mem_buffer = nullptr,
+		.no_alloc	= true,
+	};
+	ctx_ = ggml_init(params);
+
+	inp_token_ = ggml_new_tensor_1d(ctx_, GGML_TYPE_I32, 1);
+	inp_pos_   = ggml_new_tensor_1d(ctx_, GGML_TYPE_I32, 1);
+	inp_mask_  = ggml_new_tensor_2d(ctx_, GGML_TYPE_F32, p.seq_len + 1, 1);
+	ggml_set_input(inp_token_);
+	ggml_set_input(inp_pos_);
+	ggml_set_input(inp_mask_);
+
+	graph_ = ggml_new_graph_custom(ctx_, graph_size, false);
+
+	ggml_tensor *x =
+		ggml_get_rows(ctx_, model_tensor(transformer, "token_embd.weight"), inp_token_);
+	for (uint32_t L = 0; L < p.n_layers; L++) {
+		auto w = [&](const char *name) {
+			return model_tensor(transformer, fmt::format("blk.{}.{}.weight", L, name));
+		};
+
+		// attention, q / k / v of the current token
+		ggml_tensor *cur = ggml_mul(ctx_, ggml_rms_norm(ctx_, x, 1e-5f), w("attn_norm"));
+		ggml_tensor *q	 = ggml_reshape_3d(ctx_, ggml_mul_mat(ctx_, w("attn_q"), cur), head_size,
+										   p.n_heads, 1);
+		ggml_tensor *k	 = ggml_reshape_3d(ctx_, ggml_mul_mat(ctx_, w("attn_k"), cur), head_size,
+										   p.n_kv_heads, 1);
+		ggml_tensor *v	 = ggml_mul_mat(ctx_, w("attn_v"), cur);
+		q = ggml_rope_ext(ctx_, q, inp_pos_, nullptr, head_size, 0, p.seq_len, 10000.0f, 1.0f, 0.0f,
+						  1.0f, 0.0f, 0.0f);
+		k = ggml_rope_ext(ctx_, k, inp_pos_, nullptr, head_size, 0, p.seq_len, 10000.0f, 1.0f, 0.0f,
+						  1.0f, 0.0f, 0.0f);
+		// read back after the graph has run
+		ggml_set_output(k);
+		ggml_set_output(v);
+		key_cur_.push_back(k);
+		value_cur_.push_back(v);
+		v = ggml_reshape_3d(ctx_, v, head_size, p.n_kv_heads, 1);
+
+		// the cache tensors point into a RunState, so the allocator leaves them alone.
+		// forward() points them at the RunState of the step
+		uint64_t loff			 = (uint64_t)L * p.seq_len * kv_dim;
+		ggml_tensor *key_cache	 = ggml_new_tensor_3d(ctx_, GGML_TYPE_F32, head_size, p.n_kv_heads,
+													  p.seq_len);
+		ggml_tensor *value_cache = ggml_new_tensor_3d(ctx_, GGML_TYPE_F32, head_size, p.n_kv_heads,
+													  p.seq_len);
+		key_cache->data			 = transformer.state->key_cache + loff;
+		value_cache->data		 = transformer.state->value_cache + loff;
+		key_cache_.push_back(key_cache);
+		value_cache_.push_back(value_cache);
+
+		// scores over the cache followed by the current token: (seq_len + 1, 1, n_heads)
+		ggml_tensor *keys = ggml_permute(ctx_, ggml_concat(ctx_, key_cache, k, 2), 0, 2, 1, 3);
+		ggml_tensor *kq	  = ggml_mul_mat(ctx_, keys, ggml_permute(ctx_, q, 0, 2, 1, 3));
+		kq = ggml_soft_max_ext(ctx_, kq, inp_mask_, 1.0f / sqrtf(head_size), 0.0f);
+
+		// values transposed to (seq_len + 1, head_size, n_kv_heads) for the weighted sum
+		ggml_tensor *values =
+			ggml_cont(ctx_, ggml_permute(ctx_, ggml_concat(ctx_, value_cache, v, 2), 1, 2, 0, 3));
+		ggml_tensor *kqv = ggml_reshape_2d(ctx_, ggml_mul_mat(ctx_, values, kq), p.dim, 1);
+		x				 = ggml_add(ctx_, x, ggml_mul_mat(ctx_, w("attn_output"), kqv));
+
+		// ffn
+		cur				  = ggml_mul(ctx_, ggml_rms_norm(ctx_, x, 1e-5f), w("ffn_norm"));
+		ggml_tensor *gate = ggml_silu(ctx_, ggml_mul_mat(ctx_, w("ffn_gate"), cur));
+		ggml_tensor *up	  = ggml_mul_mat(ctx_, w("ffn_up"), cur);
+		x = ggml_add(ctx_, x, ggml_mul_mat(ctx_, w("ffn_down"), ggml_mul(ctx_, gate, up)));
+	}
+	x		= ggml_mul(ctx_, ggml_rms_norm(ctx_, x, 1e-5f),
+					   model_tensor(transformer, "output_norm.weight"));
+	logits_ = ggml_mul_mat(ctx_, model_tensor(transformer, "output.weight"), x);
+	ggml_set_output(logits_);
+	ggml_build_forward_expand(graph_, logits_);
+
+	backend_ = ggml_backend_cpu_init();
+	ggml_backend_cpu_set_n_threads(backend_, n_threads);
+	allocr_ = ggml_gallocr_new(ggml_backend_cpu_buffer_type());
+	if (!ggml_gallocr_alloc_graph(allocr_, graph_)) {
+		throw std::runtime_error("Failed to allocate the forward graph");
+	}
+}
+
+GraphForward::~GraphForward() {
+	ggml_gallocr_free(allocr_);
+	ggml_backend_free(backend_);
+	ggml_free(ctx_);
+}
+
+float *GraphForward::forward(RunState &s, int token, int pos) {
+	const auto &p = config_;
+	auto kv_dim	  = (p.dim * p.n_kv_heads) / p.n_heads;
+
+	*(int32_t *)inp_token_->data = token;
+	*(int32_t *)inp_pos_->data	 = pos;
+	float *mask					 = (float *)inp_mask_->data;
+	for (uint32_t t = 0; t < p.seq_len; t++) {
+		mask[t] = t < (uint32_t)pos ? 0.0f : -INFINITY;
+	}
+	mask[p.seq_len] = 0.0f; // the current token
+	for (uint32_t L = 0; L < p.n_layers; L++) {
+		uint64_t loff			= (uint64_t)L * p.seq_len * kv_dim;
+		key_cache_[L]->data		= s.key_cache + loff;
+		value_cache_[L]->data	= s.value_cache + loff;
+	}
+
+	if (ggml_backend_graph_compute(backend_, graph_) != GGML_STATUS_SUCCESS) {
+		throw std::runtime_error("Failed to compute the forward graph");
+	}
+
+	for (uint32_t L = 0; L < p.n_layers; L++) {
+		uint64_t loff = (uint64_t)L * p.seq_len * kv_dim + (uint64_t)pos * kv_dim;
+		memcpy(s.key_cache + loff, key_cur_[L]->data, kv_dim * sizeof(float));
+		memcpy(s.value_cache + loff, value_cur_[L]->data, kv_dim * sizeof(float));
+	}
+	memcpy(s.logits, logits_->data, p.vocab_size * sizeof(float));
+	return s.logits;
+}
+
+} // namespace sep
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "ggml-alloc.h"
+#include "ggml-backend.h"
+#include "ggml.h"
+#include <vector>
+
+namespace sep {
+
+struct Config;
+struct RunState;
+struct Transformer;
+
+// The forward pass of one token as a ggml graph, run by ggml's multithreaded CPU
+// backend instead of the kernels in tools.hpp. The graph is built and allocated
+// once; a step only writes the token, its position and the attention mask into the
+// input tensors.
+//
+// To keep the graph shapes fixed, the attention covers all seq_len positions of the
+// kv cache plus the current token, and the mask hides the positions not written
+// yet. The keys and values of the current token are appended to the RunState's kv
+// cache after the graph has run, so both forward paths share the same cache.
+class GraphForward {
+  public:
+	GraphForward(const Transformer &transformer, int n_threads);
+	~GraphForward();
+	GraphForward(const GraphForward &)			  = delete;
+	GraphForward &operator=(const GraphForward &) = delete;
+
+	// same contract as Transformer::forward(), the logits are written to s.logits
+	float *forward(RunState &s, int token, int pos);
+
+  private:
+	const Config &config_;
+
+	ggml_context *ctx_		 = nullptr;
+	ggml_backend_t backend_	 = nullptr;
+	ggml_gallocr_t allocr_	 = nullptr;
+	ggml_cgraph *graph_		 = nullptr;
+
+	ggml_tensor *inp_token_ = nullptr; // I32 [1]
+	ggml_tensor *inp_pos_	= nullptr; // I32 [1]
+	ggml_tensor *inp_mask_	= nullptr; // F32 [seq_len + 1], 0 or -INFINITY
+	ggml_tensor *logits_	= nullptr;
+	// per layer: the kv cache of the RunState, and the key / value of the current token
+	std::vector<ggml_tensor *> key_cache_, value_cache_;
+	std::vector<ggml_tensor *> key_cur_, value_cur_;
+};
+
+} // namespace sep
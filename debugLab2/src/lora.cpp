@@ -0,0 +1,57 @@
+#include "lora.hpp"
+#include "core.hpp"
+#include <stdexcept>
+
+namespace sep {
+
+static std::string get_string(gguf_context *ctx, const char *key) {
+	int64_t id = gguf_find_key(ctx, key);
+	return id < 0 ? "" : gguf_get_val_str(ctx, id);
+}
+
+LoraAdapter::LoraAdapter(const std::string &path, const Transformer &transformer) {
+	gguf_init_params params = {.no_alloc = false, .ctx = &ggml_ctx_};
+	gguf_ctx_				= gguf_init_from_file(path.c_str(), params);
+	if (gguf_ctx_ == nullptr) {
+		throw std::runtime_error(fmt::format("Failed to read LoRA adapter: {}", path));
+	}
+	if (get_string(gguf_ctx_, "general.type") != "adapter" ||
+		get_string(gguf_ctx_, "adapter.type") != "lora") {
+		gguf_free(gguf_ctx_);
+		ggml_free(ggml_ctx_);
+		throw std::runtime_error(fmt::format("Not a LoRA adapter: {}", path));
+	}
+	if (int64_t id = gguf_find_key(gguf_ctx_, "adapter.lora.alpha"); id >= 0) {
+		alpha_ = gguf_get_val_f32(gguf_ctx_, id);
+	}
+
+	const std::string suffix = ".lora_a";
+	for (int64_t i = 0; i < gguf_get_n_tensors(gguf_ctx_); i++) {
+		std::string name = gguf_get_tensor_name(gguf_ctx_, i);
+		if (name.size() <= suffix.size() ||
+			name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+			continue;
+		}
+		std::string base_name = name.substr(0, name.size() - suffix.size());
+		ggml_tensor *a		  = ggml_get_tensor(ggml_ctx_, name.c_str());
+		ggml_tensor *b		  = ggml_get_tensor(ggml_ctx_, (base_name + ".lora_b").c_str());
+		ggml_tensor *base	  = ggml_get_tensor(transformer.ggml_ctx_, base_name.c_str());
+		if (b == nullptr || base == nullptr || a->type != GGML_TYPE_F32 ||
+			b->type != GGML_TYPE_F32 || base->type != GGML_TYPE_F32 ||
+			a->ne[0] != base->ne[0] || b->ne[1] != base->ne[1] || a->ne[1] != b->ne[0]) {
+			gguf_free(gguf_ctx_);
+			ggml_free(ggml_ctx_);
+			throw std::runtime_error(
+				fmt::format("LoRA adapter {} does not fit the model at {}", path, base_name));
+		}
+		matrices_[(const float *)base->data] = {(float *)a->data, (float *)b->data,
+												(int)a->ne[1]};
+	}
+}
+
+LoraAdapter::~LoraAdapter() {
+	gguf_free(gguf_ctx_);
+	ggml_free(ggml_ctx_);
+}
+
+} // namespace sep
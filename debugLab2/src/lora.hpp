@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ggml.h"
+#include <string>
+#include <unordered_map>
+
+namespace sep {
+
+struct Transformer;
+
+// A LoRA adapter in the GGUF layout of llama.cpp: for a base matrix W (d, n) named
+// "<name>", the tensors "<name>.lora_a" (r, n) and "<name>.lora_b" (d, r). It is
+// not merged into W: a matmul with an active adapter adds scale * B (A x), which
+// costs r * (n + d) next to the n * d of the base matmul. Adapters only read the
+// base model, so any number of them can share it, and each RunState picks its own.
+class LoraAdapter {
+  public:
+	struct Matrices {
+		float *a; // (rank, n)
+		float *b; // (d, rank)
+		int rank;
+	};
+
+	// throws std::runtime_error if the file is not a LoRA adapter of the transformer's model
+	LoraAdapter(const std::string &path, const Transformer &transformer);
+	~LoraAdapter();
+	LoraAdapter(const LoraAdapter &)			= delete;
+	LoraAdapter &operator=(const LoraAdapter &) = delete;
+
+	// the low-rank pair of the base weight w, nullptr if the adapter leaves it alone
+	const Matrices *find(const float *w) const {
+		auto it = matrices_.find(w);
+		return it == matrices_.end() ? nullptr : &it->second;
+	}
+	// alpha / rank from the file, multiplies the scale given when it is applied
+	float scale(const Matrices &m) const { return alpha_ > 0.0f ? alpha_ / m.rank : 1.0f; }
+
+  private:
+	ggml_context *ggml_ctx_ = nullptr;
+	gguf_context *gguf_ctx_ = nullptr;
+	float alpha_			= 0.0f;
+	std::unordered_map<const float *, Matrices> matrices_; // by the base weight
+};
+
+} // namespace sep
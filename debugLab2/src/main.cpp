@@ -1,9 +1,16 @@
 
 #include "core.hpp"
+#include "serving.hpp"
+#include "session.hpp"
 #include "tools.hpp"
 
 #include "CLI/CLI.hpp"
+#include "fmt/ranges.h"
+#include <algorithm>
+#include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 using namespace sep;
 
@@ -14,6 +21,29 @@ int main(int argc, char *argv[]) {
 	std::string tokenizer_path = "./model/tintLlama-vocab.gguf";
 	int steps				   = 16;		 // number of steps to run for
 	std::string prompt		   = "One day,"; // prompt string
+	std::string session_path;				 // kv cache snapshot to resume from and save to
+	std::string vocab_cache_path;			 // prebuilt vocab tables, written on the first run
+	std::string embed_pooling;				 // print embeddings instead of text, last or mean
+	std::string grammar_regex;				 // the generated text has to match this regex
+	std::string backend		   = "naive";	 // matmul kernel, naive or llamafile
+	std::string quantize;					 // quantize the weights to q8_0 or q4_0 at load
+	std::string huge_pages	   = "none";	 // back the weights and buffers with huge pages
+	std::vector<std::string> stop_strings;	 // end the output before any of these
+	std::vector<int> stop_tokens;			 // end the output before any of these token ids
+	std::vector<std::string> lora_paths;	 // LoRA adapters applied over the model
+	std::vector<float> lora_scales;			 // scale of each adapter, 1 if not given
+	bool session_f16	  = false;
+	bool no_mmap		  = false;
+	bool check_numerics	  = false;
+	bool deterministic	  = false;
+	bool mlock			  = false;
+	int clients			  = 0; // serve the prompt to this many concurrent client threads
+	int tokenize_threads  = 1; // tokenize large prompts on this many threads
+	int embed_threads	  = 1; // embed the prompt lines on this many threads
+	int graph_threads	  = 0; // run the forward pass as a ggml graph on this many threads
+	int lookup_draft	  = 0; // check drafts of up to this many tokens found in the context
+	int lookup_ngram	  = 3; // look up the last this many tokens in the context
+	uint32_t layer_window = 0; // keep only this many layers resident, 0 for all
 
 	CLI::App app("Demo program for llama");
 
@@ -21,17 +51,167 @@ int main(int argc, char *argv[]) {
 	app.add_option("--vocab-path", tokenizer_path)->required();
 	app.add_option("--prompt", prompt)->required();
 	app.add_option("--steps", steps)->required();
+	app.add_option("--session", session_path, "Restore the kv cache from and save it to this file");
+	app.add_flag("--session-f16", session_f16, "Store the saved kv cache as fp16");
+	app.add_flag("--no-mmap", no_mmap, "Read the whole model file up front instead of mapping it");
+	app.add_option("--huge-pages", huge_pages,
+				   "Back the weights and buffers with none, transparent or explicit huge pages")
+		->check(CLI::IsMember({"none", "transparent", "explicit"}));
+	app.add_flag("--mlock", mlock, "Lock the weights and buffers in memory");
+	app.add_option("--layer-window", layer_window,
+				   "Keep only this many layers in memory, for models larger than RAM");
+	app.add_option("--backend", backend, "Matmul kernel of the forward pass, naive or llamafile")
+		->check(CLI::IsMember({"naive", "llamafile"}));
+	app.add_option("--quantize", quantize,
+				   "Quantize the weight matrices to q8_0 or q4_0 and use integer dot products")
+		->check(CLI::IsMember({"q8_0", "q4_0"}));
+	app.add_option("--graph-threads", graph_threads,
+				   "Run the forward pass as a ggml graph on this many threads, 0 for the kernels");
+	app.add_option("--lookup-draft", lookup_draft,
+				   "Prompt lookup decoding: check drafts of up to this many tokens copied from the "
+				   "context in one pass");
+	app.add_option("--lookup-ngram", lookup_ngram, "Look up the last this many tokens for drafts");
+	app.add_flag("--check-numerics", check_numerics,
+				 "Compare every kernel against the scalar reference and report the error");
+	app.add_flag("--deterministic", deterministic,
+				 "Use the fixed order reference kernels, the output does not depend on threads");
+	app.add_option("--lora", lora_paths, "Apply this LoRA adapter (GGUF), repeatable");
+	app.add_option("--lora-scale", lora_scales,
+				   "Scale of the LoRA adapter given at the same place, repeatable");
+	app.add_option("--stop", stop_strings, "End the output before this string, repeatable");
+	app.add_option("--stop-token", stop_tokens, "End the output before this token id, repeatable");
+	app.add_option("--grammar-regex", grammar_regex,
+				   "Only generate text that matches this regular expression");
+	app.add_option("--vocab-cache", vocab_cache_path, "Load the vocab from and save it to this file");
+	app.add_option("--clients", clients, "Submit the prompt from this many client threads");
+	app.add_option("--tokenize-threads", tokenize_threads, "Tokenize large prompts on this many threads");
+	app.add_option("--embed", embed_pooling,
+				   "Print the embedding of every prompt line instead of generating, pooled over "
+				   "its tokens with last or mean")
+		->check(CLI::IsMember({"last", "mean"}));
+	app.add_option("--embed-threads", embed_threads, "Embed the prompt lines on this many threads");
 	CLI11_PARSE(app, argc, argv);
 
 	// 1. load model
-	Transformer transformer(file_path);
+	memory_options().huge_pages = huge_pages == "transparent" ? HugePages::TRANSPARENT
+								  : huge_pages == "explicit"  ? HugePages::EXPLICIT
+															  : HugePages::NONE;
+	memory_options().lock		= mlock;
+	Transformer transformer(file_path, !no_mmap);
+	if (mlock) {
+		fmt::println(stderr, "locked {:.1f} MiB of weights and buffers",
+					 locked_bytes() / (1024.0 * 1024.0));
+	}
+	if (!quantize.empty()) {
+		transformer.quantize(quantize == "q4_0" ? GGML_TYPE_Q4_0 : GGML_TYPE_Q8_0);
+	}
+	transformer.set_layer_window(layer_window);
+	transformer.set_graph_threads(graph_threads);
+	transformer.lookup_draft = lookup_draft;
+	transformer.lookup_ngram = lookup_ngram;
+	std::vector<std::unique_ptr<LoraAdapter>> adapters;
+	for (size_t i = 0; i < lora_paths.size(); i++) {
+		adapters.push_back(std::make_unique<LoraAdapter>(lora_paths[i], transformer));
+		float scale = i < lora_scales.size() ? lora_scales[i] : 1.0f;
+		transformer.state->lora.emplace_back(adapters.back().get(), scale);
+	}
+	transformer.stop_tokens	 = stop_tokens;
+	transformer.stop_strings = stop_strings;
+	NumericsChecker numerics;
+	if (check_numerics) {
+		transformer.numerics = &numerics;
+	}
+	transformer.deterministic = deterministic;
+	transformer.backend		  =
+		backend == "llamafile" ? MatmulBackend::LLAMAFILE : MatmulBackend::NAIVE;
 
 	// 2. load tokenizer
-	Tokenizer tokenizer(tokenizer_path);
+	Tokenizer tokenizer(tokenizer_path, vocab_cache_path);
+	tokenizer.n_threads = tokenize_threads;
 
 	// 3. load sampler
 	Sampler sampler(transformer.config->vocab_size);
+	std::unique_ptr<RegexGrammar> grammar;
+	if (!grammar_regex.empty()) {
+		grammar			= std::make_unique<RegexGrammar>(grammar_regex, tokenizer.vocab,
+															 transformer.config->vocab_size);
+		sampler.grammar = grammar.get();
+	}
+
+	if (!session_path.empty()) {
+		try {
+			load_session(session_path, *transformer.state);
+		} catch (const std::exception &e) {
+			// start fresh, and keep the file as it is instead of overwriting it at the end
+			fmt::println(stderr, "warning: {}, starting without the session", e.what());
+			transformer.state->tokens.clear();
+			session_path.clear();
+		}
+	}
+
+	if (!embed_pooling.empty()) {
+		std::vector<std::vector<int>> inputs;
+		size_t begin = 0;
+		while (begin <= prompt.size()) {
+			size_t end = std::min(prompt.find('\n', begin), prompt.size());
+			inputs.push_back(tokenizer.tokenize(prompt.substr(begin, end - begin), true));
+			begin = end + 1;
+		}
+		auto pooling =
+			embed_pooling == "mean" ? Transformer::Pooling::MEAN : Transformer::Pooling::LAST;
+		for (auto &embedding : transformer.embed(inputs, pooling, embed_threads)) {
+			fmt::println("{:.6f}", fmt::join(embedding, " "));
+		}
+		if (check_numerics) {
+			numerics.report(stderr);
+		}
+		return 0;
+	}
 
 	// 4. generate tokens
-	transformer.generate(&tokenizer, &sampler, prompt, steps);
+	if (clients > 0) {
+		auto prompt_tokens = tokenizer.tokenize(prompt, true);
+		std::vector<std::string> outputs(clients);
+		std::vector<std::thread> threads;
+		Server server(&transformer, &tokenizer, &sampler);
+		for (int i = 0; i < clients; i++) {
+			threads.emplace_back([&, i] {
+				auto stream = server.submit(prompt_tokens, steps);
+				Detokenizer detokenizer(&tokenizer);
+				StopMatcher stop(stop_strings);
+				int token;
+				while (!stop.stopped() && stream->next(token)) {
+					outputs[i] += stop.push(detokenizer.push(token));
+				}
+				// the rest of the generation is not needed
+				stream->cancelled.store(true, std::memory_order_relaxed);
+				outputs[i] += stop.push(detokenizer.flush());
+				outputs[i] += stop.flush();
+				if (!stop.stopped() && !stream->error.empty()) {
+					fmt::println(stderr, "[client {}] generation failed: {}", i, stream->error);
+				}
+			});
+		}
+		for (auto &t : threads) {
+			t.join();
+		}
+		server.stop();
+		for (int i = 0; i < clients; i++) {
+			fmt::println("[client {}] {}{}", i, prompt, outputs[i]);
+		}
+	} else {
+		transformer.generate(&tokenizer, &sampler, prompt, steps);
+	}
+
+	if (check_numerics) {
+		numerics.report(stderr);
+	}
+	if (lookup_draft > 0) {
+		fmt::println(stderr, "prompt lookup: {} of {} draft tokens accepted",
+					 transformer.n_accepted, transformer.n_drafted);
+	}
+
+	if (!session_path.empty()) {
+		save_session(session_path, *transformer.state, session_f16);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,140 @@
+#include "model_mapping.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace sep {
+
+ModelMapping::ModelMapping(const std::string &path, bool copy) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(fmt::format("Failed to open model file: {}", path));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		throw std::runtime_error(fmt::format("Invalid model file: {}", path));
+	}
+	size_ = st.st_size;
+	fd_	  = fd;
+	if (copy) {
+		copy_ = std::make_unique<PageBuffer>(size_);
+		data_ = copy_->data();
+		for (size_t done = 0; done < size_;) {
+			ssize_t n = pread(fd, data_ + done, size_ - done, done);
+			if (n <= 0) {
+				close(fd);
+				throw std::runtime_error(fmt::format("Failed to read model file: {}", path));
+			}
+			done += n;
+		}
+		return;
+	}
+	void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error(fmt::format("Failed to map model file: {}", path));
+	}
+	data_ = (char *)addr;
+	if (memory_options().lock) {
+		locked_ = lock_memory(data_, size_);
+	}
+}
+
+ModelMapping::~ModelMapping() {
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		shutdown_ = true;
+		generation_.fetch_add(1, std::memory_order_relaxed);
+	}
+	wake_.notify_one();
+	if (prefetcher_.joinable()) {
+		prefetcher_.join();
+	}
+	if (locked_) {
+		unlock_memory(data_, size_);
+	}
+	if (copy_ == nullptr) {
+		munmap(data_, size_);
+	}
+	close(fd_);
+}
+
+void ModelMapping::release(const char *begin, size_t len) {
+	if (!releasable()) {
+		return;
+	}
+	// only the pages entirely inside the region, the neighbouring tensors may share the others
+	const size_t page = sysconf(_SC_PAGESIZE);
+	auto first		  = ((uintptr_t)begin + page - 1) / page * page;
+	auto last		  = ((uintptr_t)begin + len) / page * page;
+	if (first >= last) {
+		return;
+	}
+	madvise((void *)first, last - first, MADV_DONTNEED);
+	posix_fadvise(fd_, first - (uintptr_t)data_, last - first, POSIX_FADV_DONTNEED);
+}
+
+void ModelMapping::prefetch(std::vector<std::pair<const char *, size_t>> regions) {
+	if (copy_ != nullptr || locked_) {
+		return; // already resident
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_	 = std::move(regions);
+		has_pending_ = true;
+		generation_.fetch_add(1, std::memory_order_relaxed);
+		if (!prefetcher_.joinable()) {
+			prefetcher_ = std::thread([this] { prefetch_loop(); });
+		}
+	}
+	wake_.notify_one();
+}
+
+void ModelMapping::prefetch_loop() {
+	const size_t page  = sysconf(_SC_PAGESIZE);
+	const size_t chunk = 1 << 20; // recheck generation_ this often
+	for (;;) {
+		std::vector<std::pair<const char *, size_t>> regions;
+		uint64_t generation;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [this] { return has_pending_ || shutdown_; });
+			if (shutdown_) {
+				return;
+			}
+			regions		 = std::move(pending_);
+			has_pending_ = false;
+			generation	 = generation_.load(std::memory_order_relaxed);
+		}
+		// returns early once a newer prefetch replaces this one
+		auto read = [&] {
+			for (auto [begin, len] : regions) {
+				// round out to whole pages, madvise needs a page aligned address
+				auto first = (uintptr_t)begin / page * page;
+				auto last  = ((uintptr_t)begin + len + page - 1) / page * page;
+				for (uintptr_t p = first; p < last; p += chunk) {
+					if (generation_.load(std::memory_order_relaxed) != generation) {
+						return;
+					}
+					size_t n = std::min<size_t>(chunk, last - p);
+					madvise((void *)p, n, MADV_WILLNEED);
+					// touch every page, so that they are mapped and not just in the page cache
+					volatile char sink;
+					for (uintptr_t q = p; q < p + n; q += page) {
+						sink = *(const volatile char *)q;
+					}
+					(void)sink;
+				}
+			}
+		};
+		read();
+	}
+}
+
+} // namespace sep
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "page_buffer.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sep {
+
+// Read-only mapping of a model file. Tensors point straight into the mapping, so
+// their data is only read from disk when it is first touched. prefetch() faults
+// the pages in on a background thread, in the order the forward pass needs them,
+// so the first layers can run while the later ones are still loading. The thread
+// is started by the first prefetch() and serves every later one.
+//
+// With copy, the file is read up front into a PageBuffer instead, for huge pages
+// (which the kernel does not give file mappings). With memory_options().lock a
+// mapping is mlock()ed as a whole, which reads it in as well.
+class ModelMapping {
+  public:
+	explicit ModelMapping(const std::string &path, bool copy = false);
+	~ModelMapping();
+	ModelMapping(const ModelMapping &)			  = delete;
+	ModelMapping &operator=(const ModelMapping &) = delete;
+
+	// writing through this pointer faults, the mapping is read-only
+	char *data() const { return data_; }
+	size_t size() const { return size_; }
+	// false for a copy or a locked mapping, their pages stay resident
+	bool releasable() const { return copy_ == nullptr && !locked_; }
+
+	// reads the regions in order on the background thread, replacing any earlier
+	// prefetch that has not finished yet. Does not wait for the thread.
+	void prefetch(std::vector<std::pair<const char *, size_t>> regions);
+	// drops the pages of a region from this process and from the page cache, the next
+	// access reads them from disk again. Does nothing unless releasable().
+	void release(const char *begin, size_t len);
+
+  private:
+	void prefetch_loop();
+
+	int fd_		 = -1; // kept open for posix_fadvise
+	char *data_	 = nullptr;
+	size_t size_ = 0;
+	bool locked_ = false;
+	std::unique_ptr<PageBuffer> copy_;
+	std::thread prefetcher_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::vector<std::pair<const char *, size_t>> pending_; // guarded by mutex_
+	bool has_pending_ = false;							   // guarded by mutex_
+	bool shutdown_	  = false;							   // guarded by mutex_
+	// bumped by every prefetch() and on shutdown, the thread drops a job once it changes
+	std::atomic<uint64_t> generation_{0};
+};
+
+} // namespace sep
@@ -0,0 +1,99 @@
+#include "numerics.hpp"
+#include "fmt/format.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace sep {
+
+void ref_rmsnorm(float *o, const float *x, const float *weight, int64_t size) {
+	float ss = 0.0f;
+	for (int64_t j = 0; j < size; j++) {
+		ss += x[j] * x[j];
+	}
+	ss /= size;
+	ss += 1e-5f;
+	ss = 1.0f / sqrtf(ss);
+	for (int64_t j = 0; j < size; j++) {
+		o[j] = weight[j] * (ss * x[j]);
+	}
+}
+
+void ref_matmul(float *xout, const float *x, const float *w, int n, int d) {
+	for (int i = 0; i < d; i++) {
+		float val = 0.0f;
+		for (int j = 0; j < n; j++) {
+			val += w[(int64_t)i * n + j] * x[j];
+		}
+		xout[i] = val;
+	}
+}
+
+void ref_softmax(float *x, int64_t size) {
+	float max_val = x[0];
+	for (int64_t i = 1; i < size; i++) {
+		max_val = std::max(max_val, x[i]);
+	}
+	float sum = 0.0f;
+	for (int64_t i = 0; i < size; i++) {
+		x[i] = expf(x[i] - max_val);
+		sum += x[i];
+	}
+	for (int64_t i = 0; i < size; i++) {
+		x[i] /= sum;
+	}
+}
+
+// distance in units in the last place, counted across zero
+static int64_t ulp_distance(float a, float b) {
+	if (std::isnan(a) || std::isnan(b)) {
+		return std::isnan(a) && std::isnan(b) ? 0 : std::numeric_limits<int64_t>::max();
+	}
+	// map the sign-magnitude bits onto a line ordered like the floats
+	auto ordered = [](float f) {
+		int32_t i;
+		memcpy(&i, &f, sizeof(i));
+		return i < 0 ? (int64_t)std::numeric_limits<int32_t>::min() - i : (int64_t)i;
+	};
+	return std::abs(ordered(a) - ordered(b));
+}
+
+void NumericsChecker::compare(const char *op, int layer, const float *out, const float *ref,
+							  int64_t n) {
+	int64_t max_ulp = 0;
+	double max_rel	= 0.0;
+	for (int64_t i = 0; i < n; i++) {
+		max_ulp		= std::max(max_ulp, ulp_distance(out[i], ref[i]));
+		double diff = std::fabs((double)out[i] - ref[i]);
+		double mag	= std::max(std::fabs((double)out[i]), std::fabs((double)ref[i]));
+		if (diff > 0.0) {
+			max_rel = std::max(max_rel, diff / mag);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto [it, inserted] = index_.try_emplace({op, layer}, stats_.size());
+	if (inserted) {
+		stats_.push_back(Stat{.op = op, .layer = layer});
+	}
+	Stat &stat = stats_[it->second];
+	stat.calls++;
+	stat.values += n;
+
+	stat.max_ulp = std::max(stat.max_ulp, max_ulp);
+	stat.max_rel = std::max(stat.max_rel, max_rel);
+}
+
+void NumericsChecker::report(FILE *f) const {
+	std::lock_guard<std::mutex> lock(mutex_);
+	fmt::println(f, "{:<12} {:>5} {:>8} {:>12} {:>10} {:>12}", "op", "layer", "calls", "values",
+				 "max ulp", "max rel");
+	for (auto &stat : stats_) {
+		auto layer = stat.layer < 0 ? std::string("-") : std::to_string(stat.layer);
+		fmt::println(f, "{:<12} {:>5} {:>8} {:>12} {:>10} {:>12.3e}", stat.op, layer, stat.calls,
+					 stat.values, stat.max_ulp, stat.max_rel);
+	}
+}
+
+} // namespace sep
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sep {
+
+// Scalar reference kernels. Every sum runs left to right in float, so the result only
+// depends on the inputs, never on the thread count or the vector width of the kernels
+// in tools.hpp. They are the baseline for NumericsChecker and the kernels of the
+// deterministic mode.
+void ref_rmsnorm(float *o, const float *x, const float *weight, int64_t size);
+// W (d,n) @ x (n,) -> xout (d,)
+void ref_matmul(float *xout, const float *x, const float *w, int n, int d);
+void ref_softmax(float *x, int64_t size);
+
+// Collects the error of the optimized kernels against the reference kernels, per op
+// and layer. compare() may be called from several threads.
+class NumericsChecker {
+  public:
+	// records the difference of out against ref, layer -1 for the ops outside the layers
+	void compare(const char *op, int layer, const float *out, const float *ref, int64_t n);
+	// prints one line per op and layer, in the order they were first seen
+	void report(FILE *f) const;
+
+  private:
+	struct Stat {
+		std::string op;
+		int layer;
+		uint64_t calls	= 0;
+		uint64_t values = 0;
+		int64_t max_ulp = 0;
+		double max_rel	= 0.0;
+	};
+
+	mutable std::mutex mutex_;
+	std::vector<Stat> stats_;
+	std::map<std::pair<std::string, int>, size_t> index_; // (op, layer) -> stats_
+};
+
+} // namespace sep
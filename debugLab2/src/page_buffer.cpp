@@ -0,0 +1,89 @@
+#include "page_buffer.hpp"
+#include "fmt/format.h"
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace sep {
+
+static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+
+static std::atomic<size_t> locked_bytes_{0};
+
+MemoryOptions &memory_options() {
+	static MemoryOptions options;
+	return options;
+}
+
+bool lock_memory(const void *begin, size_t len) {
+	if (mlock(begin, len) != 0) {
+		fmt::println(stderr, "warning: failed to lock {} MiB: {} (see ulimit -l)", len >> 20,
+					 strerror(errno));
+		return false;
+	}
+	locked_bytes_ += len;
+	return true;
+}
+
+void unlock_memory(const void *begin, size_t len) {
+	munlock(begin, len);
+	locked_bytes_ -= len;
+}
+
+size_t locked_bytes() { return locked_bytes_; }
+
+static size_t round_up(size_t size, size_t align) { return (size + align - 1) / align * align; }
+
+PageBuffer::PageBuffer(size_t size) : size_(size) {
+	size				= size > 0 ? size : 1; // mmap does not take empty mappings
+	const auto &options = memory_options();
+	void *addr			= MAP_FAILED;
+	if (options.huge_pages == HugePages::EXPLICIT) {
+		mapped_ = round_up(size, HUGE_PAGE_SIZE);
+		addr	= mmap(nullptr, mapped_, PROT_READ | PROT_WRITE,
+					   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (addr == MAP_FAILED) {
+			fmt::println(stderr, "warning: no {} MiB of explicit huge pages, using regular pages",
+						 mapped_ >> 20);
+		}
+	}
+	if (addr == MAP_FAILED && options.huge_pages == HugePages::TRANSPARENT) {
+		// over-allocate by a huge page and trim, so that the buffer starts on a boundary
+		mapped_	   = round_up(size, HUGE_PAGE_SIZE);
+		char *base = (char *)mmap(nullptr, mapped_ + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+								  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base != MAP_FAILED) {
+			char *aligned = (char *)round_up((uintptr_t)base, HUGE_PAGE_SIZE);
+			if (aligned > base) {
+				munmap(base, aligned - base);
+			}
+			munmap(aligned + mapped_, base + HUGE_PAGE_SIZE - aligned);
+			madvise(aligned, mapped_, MADV_HUGEPAGE);
+			addr = aligned;
+		}
+	}
+	if (addr == MAP_FAILED) {
+		mapped_ = round_up(size, sysconf(_SC_PAGESIZE));
+		addr = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	}
+	if (addr == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	data_ = (char *)addr;
+	if (options.lock) {
+		locked_ = lock_memory(data_, mapped_);
+	}
+}
+
+PageBuffer::~PageBuffer() {
+	if (locked_) {
+		unlock_memory(data_, mapped_);
+	}
+	munmap(data_, mapped_);
+}
+
+} // namespace sep
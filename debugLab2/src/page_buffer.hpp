@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+
+namespace sep {
+
+// How the weights and the RunState buffers are backed. Process wide, set before the
+// model is loaded.
+enum class HugePages {
+	NONE,		 // regular pages
+	TRANSPARENT, // 2 MiB aligned and madvise(MADV_HUGEPAGE), the kernel collapses them
+	EXPLICIT,	 // MAP_HUGETLB from the reserved pool (vm.nr_hugepages)
+};
+
+struct MemoryOptions {
+	HugePages huge_pages = HugePages::NONE;
+	bool lock			 = false; // mlock, so that the pages are never swapped out
+};
+
+MemoryOptions &memory_options();
+
+// mlock()s a region and counts it in locked_bytes(), warns and returns false when the
+// limit (RLIMIT_MEMLOCK) does not allow it
+bool lock_memory(const void *begin, size_t len);
+void unlock_memory(const void *begin, size_t len);
+// bytes locked by lock_memory() and not unlocked yet
+size_t locked_bytes();
+
+// Zeroed anonymous memory backed and locked according to memory_options(). Explicit
+// huge pages fall back to regular ones with a warning when the pool is too small.
+class PageBuffer {
+  public:
+	explicit PageBuffer(size_t size);
+	~PageBuffer();
+	PageBuffer(const PageBuffer &)			  = delete;
+	PageBuffer &operator=(const PageBuffer &) = delete;
+
+	char *data() const { return data_; }
+	size_t size() const { return size_; }
+
+  private:
+	char *data_	   = nullptr;
+	size_t size_   = 0;
+	size_t mapped_ = 0; // size_ rounded up to whole (huge) pages
+	bool locked_   = false;
+};
+
+} // namespace sep
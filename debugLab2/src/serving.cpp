@@ -0,0 +1,117 @@
+#include "serving.hpp"
+#include <chrono>
+
+namespace sep {
+
+void Backoff::pause() {
+	if (spins < 64) {
+		spins++;
+	} else if (spins < 128) {
+		spins++;
+		std::this_thread::yield();
+	} else {
+		std::this_thread::sleep_for(std::chrono::microseconds(50));
+	}
+}
+
+bool TokenStream::next(int &token) {
+	Backoff backoff;
+	for (;;) {
+		if (ring.try_pop(token)) {
+			return true;
+		}
+		// done is published after the last push, so recheck the ring once it is set
+		if (done.load(std::memory_order_acquire)) {
+			return ring.try_pop(token);
+		}
+		backoff.pause();
+	}
+}
+
+Server::Server(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
+			   size_t queue_capacity, size_t stream_capacity)
+	: transformer_(transformer), tokenizer_(tokenizer), sampler_(sampler),
+	  stream_capacity_(stream_capacity), queue_(queue_capacity) {
+	scheduler_ = std::thread([this] { run(); });
+}
+
+Server::~Server() { stop(); }
+
+std::shared_ptr<TokenStream> Server::try_submit(std::vector<int> prompt_tokens, int steps) {
+	if (prompt_tokens.empty()) {
+		throw std::invalid_argument("expected at least 1 prompt token");
+	}
+	auto stream = std::make_shared<TokenStream>(stream_capacity_);
+	Request req{std::move(prompt_tokens), steps, stream};
+	if (!queue_.try_push(std::move(req))) {
+		return nullptr;
+	}
+	return stream;
+}
+
+std::shared_ptr<TokenStream> Server::submit(std::vector<int> prompt_tokens, int steps) {
+	Backoff backoff;
+	for (;;) {
+		auto stream = try_submit(prompt_tokens, steps);
+		if (stream != nullptr) {
+			return stream;
+		}
+		backoff.pause();
+	}
+}
+
+void Server::stop() {
+	stopping_.store(true, std::memory_order_release);
+	if (scheduler_.joinable()) {
+		scheduler_.join();
+	}
+}
+
+void Server::run() {
+	Backoff backoff;
+	Request req;
+	for (;;) {
+		if (queue_.try_pop(req)) {
+			serve(req);
+			req = Request{};
+			backoff.reset();
+		} else if (stopping_.load(std::memory_order_acquire)) {
+			break;
+		} else {
+			backoff.pause();
+		}
+	}
+}
+
+void Server::serve(Request &req) {
+	auto &stream = *req.stream;
+	// the prompt is echoed by generate(), only stream the sampled tokens
+	int n_forced = req.prompt_tokens.size() - 1;
+	auto on_token = [&](int token) {
+		if (stream.cancelled.load(std::memory_order_relaxed)) {
+			return false;
+		}
+		if (n_forced > 0) {
+			n_forced--;
+			return true;
+		}
+		// the client is slower than the model: wait for it instead of dropping tokens
+		Backoff backoff;
+		while (!stream.ring.try_push(token)) {
+			if (stream.cancelled.load(std::memory_order_relaxed)) {
+				return false;
+			}
+			backoff.pause();
+		}
+		return true;
+	};
+	// a failed request ends its stream with the error, the scheduler goes on with the next one
+	try {
+		transformer_->generate(tokenizer_, sampler_, req.prompt_tokens, req.steps, on_token);
+	} catch (const std::exception &e) {
+		stream.error = e.what();
+	}
+	stream.done.store(true, std::memory_order_release);
+}
+
+} // namespace sep
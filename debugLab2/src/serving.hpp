@@ -0,0 +1,202 @@
+#pragma once
+
+#include "core.hpp"
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace sep {
+
+// keep producer and consumer owned indices on different cache lines
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Bounded multi-producer / multi-consumer queue (Dmitry Vyukov's algorithm).
+// Every cell carries a sequence number telling whether it is ready to be written
+// (seq == pos) or read (seq == pos + 1), so producers and consumers only contend
+// on a single CAS of their own index. capacity must be a power of two.
+template <typename T> class MPMCQueue {
+  public:
+	explicit MPMCQueue(size_t capacity) : cells_(new Cell[capacity]), mask_(capacity - 1) {
+		if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+			throw std::invalid_argument("MPMCQueue capacity must be a power of two");
+		}
+		for (size_t i = 0; i < capacity; i++) {
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+		enqueue_pos_.store(0, std::memory_order_relaxed);
+		dequeue_pos_.store(0, std::memory_order_relaxed);
+	}
+	MPMCQueue(const MPMCQueue &)			= delete;
+	MPMCQueue &operator=(const MPMCQueue &) = delete;
+
+	// returns false if the queue is full
+	bool try_push(T &&value) {
+		Cell *cell;
+		size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+		for (;;) {
+			cell		  = &cells_[pos & mask_];
+			size_t seq	  = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = enqueue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		cell->data = std::move(value);
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// returns false if the queue is empty
+	bool try_pop(T &value) {
+		Cell *cell;
+		size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+		for (;;) {
+			cell		  = &cells_[pos & mask_];
+			size_t seq	  = cell->seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					break;
+				}
+			} else if (diff < 0) {
+				return false;
+			} else {
+				pos = dequeue_pos_.load(std::memory_order_relaxed);
+			}
+		}
+		value = std::move(cell->data);
+		cell->seq.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+  private:
+	struct alignas(CACHE_LINE_SIZE) Cell {
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells_;
+	const size_t mask_;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> enqueue_pos_;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> dequeue_pos_;
+};
+
+// Bounded single-producer / single-consumer ring buffer. Each side caches the
+// other side's index and only reloads it when the ring looks full / empty.
+// capacity must be a power of two.
+template <typename T> class SPSCRing {
+  public:
+	explicit SPSCRing(size_t capacity) : buf_(capacity), mask_(capacity - 1) {
+		if (capacity < 2 || (capacity & (capacity - 1)) != 0) {
+			throw std::invalid_argument("SPSCRing capacity must be a power of two");
+		}
+	}
+	SPSCRing(const SPSCRing &)			  = delete;
+	SPSCRing &operator=(const SPSCRing &) = delete;
+
+	// producer side, returns false if the ring is full
+	bool try_push(const T &value) {
+		size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_cache_ > mask_) {
+			head_cache_ = head_.load(std::memory_order_acquire);
+			if (tail - head_cache_ > mask_) {
+				return false;
+			}
+		}
+		buf_[tail & mask_] = value;
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// consumer side, returns false if the ring is empty
+	bool try_pop(T &value) {
+		size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_cache_) {
+			tail_cache_ = tail_.load(std::memory_order_acquire);
+			if (head == tail_cache_) {
+				return false;
+			}
+		}
+		value = buf_[head & mask_];
+		head_.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+  private:
+	std::vector<T> buf_;
+	const size_t mask_;
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> head_{0}; // written by the consumer
+	size_t tail_cache_ = 0;								   // consumer's copy of tail_
+	alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail_{0}; // written by the producer
+	size_t head_cache_ = 0;								   // producer's copy of head_
+};
+
+// Waits in a polling loop without burning a whole core once the wait gets long.
+struct Backoff {
+	int spins = 0;
+	void pause();
+	void reset() { spins = 0; }
+};
+
+// Tokens of one request, streamed from the scheduler thread to the client thread.
+struct TokenStream {
+	SPSCRing<int> ring;
+	std::atomic<bool> done{false};		// set by the scheduler after the last token
+	std::atomic<bool> cancelled{false}; // set by the client to stop the generation
+	// why the generation failed, empty if it did not. Written before done is set, read it once
+	// next() has returned false
+	std::string error;
+
+	explicit TokenStream(size_t capacity) : ring(capacity) {}
+
+	// blocks until the next token is available, returns false at the end of the stream
+	bool next(int &token);
+};
+
+struct Request {
+	std::vector<int> prompt_tokens;
+	int steps = 0;
+	std::shared_ptr<TokenStream> stream;
+};
+
+// Serving loop around a single Transformer. Any number of client threads submit
+// requests into a lock-free queue; one scheduler thread owns the model, runs the
+// requests one after another and streams the sampled tokens back.
+class Server {
+  public:
+	Server(Transformer *transformer, Tokenizer *tokenizer, Sampler *sampler,
+		   size_t queue_capacity = 64, size_t stream_capacity = 256);
+	~Server();
+
+	// returns nullptr if the request queue is full
+	std::shared_ptr<TokenStream> try_submit(std::vector<int> prompt_tokens, int steps);
+	// waits for a free slot in the request queue
+	std::shared_ptr<TokenStream> submit(std::vector<int> prompt_tokens, int steps);
+	// finishes the queued requests and joins the scheduler thread
+	void stop();
+
+  private:
+	void run();
+	void serve(Request &req);
+
+	Transformer *transformer_;
+	Tokenizer *tokenizer_;
+	Sampler *sampler_;
+	size_t stream_capacity_;
+	MPMCQueue<Request> queue_;
+	std::atomic<bool> stopping_{false};
+	std::thread scheduler_;
+};
+
+} // namespace sep
@@ -0,0 +1,119 @@
+#include "session.hpp"
+#include "ggml.h"
+#include <cstdio>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sep {
+
+static constexpr uint32_t SESSION_ALIGNMENT = 32;
+
+void save_session(const std::string &path, const RunState &s, bool f16) {
+	auto p		   = s.config;
+	auto kv_dim	   = (p->dim * p->n_kv_heads) / p->n_heads;
+	auto n_tokens  = (uint32_t)s.tokens.size();
+	auto data_offs = sizeof(SessionHeader) + sizeof(int32_t) * n_tokens;
+	data_offs	   = (data_offs + SESSION_ALIGNMENT - 1) / SESSION_ALIGNMENT * SESSION_ALIGNMENT;
+
+	SessionHeader header = {
+		.magic		 = SESSION_MAGIC,
+		.version	 = SESSION_VERSION,
+		.type		 = f16 ? SESSION_F16 : SESSION_F32,
+		.n_layers	 = p->n_layers,
+		.seq_len	 = p->seq_len,
+		.kv_dim		 = kv_dim,
+		.n_tokens	 = n_tokens,
+		.data_offset = (uint32_t)data_offs,
+	};
+
+	FILE *f = fopen(path.c_str(), "wb");
+	if (f == nullptr) {
+		throw std::runtime_error(fmt::format("Failed to open session file: {}", path));
+	}
+	std::vector<char> padding(data_offs - sizeof(header) - sizeof(int32_t) * n_tokens, 0);
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(s.tokens.data(), sizeof(int32_t), n_tokens, f);
+	fwrite(padding.data(), 1, padding.size(), f);
+
+	// only the rows [0, n_tokens) of every layer are in use
+	uint64_t n_elems = (uint64_t)n_tokens * kv_dim;
+	std::vector<ggml_fp16_t> buf(f16 ? n_elems : 0);
+	for (uint32_t L = 0; L < p->n_layers; L++) {
+		uint64_t loff = (uint64_t)L * p->seq_len * kv_dim;
+		for (const float *cache : {s.key_cache + loff, s.value_cache + loff}) {
+			if (f16) {
+				ggml_fp32_to_fp16_row(cache, buf.data(), n_elems);
+				fwrite(buf.data(), sizeof(ggml_fp16_t), n_elems, f);
+			} else {
+				fwrite(cache, sizeof(float), n_elems, f);
+			}
+		}
+	}
+
+	bool ok = !ferror(f);
+	ok		= (fclose(f) == 0) && ok;
+	if (!ok) {
+		throw std::runtime_error(fmt::format("Failed to write session file: {}", path));
+	}
+}
+
+bool load_session(const std::string &path, RunState &s) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SessionHeader)) {
+		close(fd);
+		throw std::runtime_error(fmt::format("Invalid session file: {}", path));
+	}
+	size_t size = st.st_size;
+	void *addr	= mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		throw std::runtime_error(fmt::format("Failed to map session file: {}", path));
+	}
+
+	auto p		  = s.config;
+	auto kv_dim	  = (p->dim * p->n_kv_heads) / p->n_heads;
+	auto *data	  = (const char *)addr;
+	auto header	  = *(const SessionHeader *)data;
+	size_t elsize = header.type == SESSION_F16 ? sizeof(ggml_fp16_t) : sizeof(float);
+	uint64_t n_elems = (uint64_t)header.n_tokens * kv_dim;
+
+	bool valid = header.magic == SESSION_MAGIC && header.version == SESSION_VERSION &&
+				 (header.type == SESSION_F32 || header.type == SESSION_F16) &&
+				 header.n_layers == p->n_layers && header.seq_len == p->seq_len &&
+				 header.kv_dim == kv_dim && header.n_tokens <= p->seq_len &&
+				 header.data_offset >= sizeof(header) + sizeof(int32_t) * header.n_tokens &&
+				 header.data_offset + 2 * p->n_layers * n_elems * elsize <= size;
+	if (!valid) {
+		munmap(addr, size);
+		throw std::runtime_error(fmt::format("Session file does not match the model: {}", path));
+	}
+
+	auto tokens = (const int32_t *)(data + sizeof(header));
+	s.tokens.assign(tokens, tokens + header.n_tokens);
+
+	const char *src = data + header.data_offset;
+	for (uint32_t L = 0; L < p->n_layers; L++) {
+		uint64_t loff = (uint64_t)L * p->seq_len * kv_dim;
+		for (float *cache : {s.key_cache + loff, s.value_cache + loff}) {
+			if (header.type == SESSION_F16) {
+				ggml_fp16_to_fp32_row((const ggml_fp16_t *)src, cache, n_elems);
+			} else {
+				memcpy(cache, src, n_elems * sizeof(float));
+			}
+			src += n_elems * elsize;
+		}
+	}
+
+	munmap(addr, size);
+	return true;
+}
+
+} // namespace sep
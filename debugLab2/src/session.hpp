@@ -0,0 +1,32 @@
+#pragma once
+
+#include "core.hpp"
+#include <cstdint>
+#include <string>
+
+namespace sep {
+
+// Snapshot of the used prefix of a RunState's kv cache.
+// layout: SessionHeader | tokens (int32, n_tokens) | padding | per layer: keys, values
+// each of keys / values is (n_tokens, kv_dim), stored as f32 or f16
+struct SessionHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type; // SESSION_F32 / SESSION_F16
+	uint32_t n_layers;
+	uint32_t seq_len;
+	uint32_t kv_dim;
+	uint32_t n_tokens;
+	uint32_t data_offset; // offset of the first layer's keys, from the beginning of the file
+};
+
+constexpr uint32_t SESSION_MAGIC   = 0x53455353; // "SESS"
+constexpr uint32_t SESSION_VERSION = 1;
+constexpr uint32_t SESSION_F32	   = 0;
+constexpr uint32_t SESSION_F16	   = 1;
+
+void save_session(const std::string &path, const RunState &s, bool f16);
+// returns false if there is no session file at `path`, throws if the file does not fit the model
+bool load_session(const std::string &path, RunState &s);
+
+} // namespace sep
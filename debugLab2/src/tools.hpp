@@ -2,6 +2,7 @@
 
 #include "fmt/format.h"
 #include "ggml.h"
+#include <algorithm>
 #include <ctime>
 #include <string>
 namespace sep {
@@ -28,6 +29,26 @@ static int sample_argmax(float *probabilities, int n) {
 	return max_i;
 }
 
+static int sample_argmax_masked(const float *probabilities, const uint64_t *mask,
+								size_t n_words, int n) {
+	// argmax over the indices whose bit is set, a whole word of disallowed indices is
+	// skipped at once. Only the n_words words of mask are read, the indices past them
+	// are not allowed. Returns -1 if no index is allowed
+	int max_i	  = -1;
+	float max_p	  = 0.0f;
+	const int end = (int)std::min<size_t>(n_words, ((size_t)n + 63) / 64);
+	for (int w = 0; w < end; w++) {
+		for (uint64_t bits = mask[w]; bits != 0; bits &= bits - 1) {
+			int i = w * 64 + __builtin_ctzll(bits);
+			if (i < n && (max_i < 0 || probabilities[i] > max_p)) {
+				max_i = i;
+				max_p = probabilities[i];
+			}
+		}
+	}
+	return max_i;
+}
+
 static void rmsnorm(float *o, float *x, float *weight, int64_t size) {
 	// calculate sum of squares
 	float ss = 0.0f;
@@ -57,6 +78,22 @@ static void matmul(float *xout, float *x, float *w, int n, int d) {
 	}
 }
 
+static void matmul_batch(float *xout, float *x, float *w, int n, int d, int n_tokens) {
+	// W (d,n) @ X (n_tokens,n)^T -> xout (n_tokens,d)
+	// every row of W is read once for all the tokens, the sums run in the order of matmul()
+	int i;
+#pragma omp parallel for private(i)
+	for (i = 0; i < d; i++) {
+		for (int t = 0; t < n_tokens; t++) {
+			float val = 0.0f;
+			for (int j = 0; j < n; j++) {
+				val += w[i * n + j] * x[t * n + j];
+			}
+			xout[t * d + i] = val;
+		}
+	}
+}
+
 static void softmax(float *x, int64_t size) {
 	// find max value (for numerical stability)
 	float max_val = x[0];
@@ -0,0 +1,125 @@
+#include "vocab_cache.hpp"
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace sep {
+
+// maps the whole file read-only, returns nullptr if it cannot be opened
+static const char *map_file(const std::string &path, size_t &size) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return nullptr;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return nullptr;
+	}
+	size	   = st.st_size;
+	void *addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return addr == MAP_FAILED ? nullptr : (const char *)addr;
+}
+
+// FNV-1a over 8 byte words, the tail byte by byte
+static uint64_t hash_bytes(const char *data, size_t size) {
+	uint64_t hash = 14695981039346656037ull;
+	size_t i	  = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ word) * 1099511628211ull;
+	}
+	for (; i < size; i++) {
+		hash = (hash ^ (uint8_t)data[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+// hashes the first meta_size bytes of the GGUF file, returns false if it is shorter.
+// Only those pages are read, the tensor data of a model file is never touched.
+static bool hash_gguf_metadata(const std::string &gguf_path, uint64_t meta_size, uint64_t &hash) {
+	size_t size;
+	const char *data = map_file(gguf_path, size);
+	if (data == nullptr) {
+		return false;
+	}
+	bool ok = meta_size <= size;
+	if (ok) {
+		hash = hash_bytes(data, meta_size);
+	}
+	munmap((void *)data, size);
+	return ok;
+}
+
+bool save_vocab_cache(const std::string &path, const std::string &gguf_path, uint64_t meta_size,
+					  const llama_vocab &vocab) {
+	VocabCacheHeader header = {
+		.magic		   = VOCAB_CACHE_MAGIC,
+		.version	   = VOCAB_CACHE_VERSION,
+		.meta_size	   = meta_size,
+		.meta_hash	   = 0,
+		.snapshot_size = 0,
+	};
+	if (!hash_gguf_metadata(gguf_path, meta_size, header.meta_hash)) {
+		return false;
+	}
+	std::vector<char> snapshot;
+	llama_vocab_save(vocab, snapshot);
+	header.snapshot_size = snapshot.size();
+
+	// write a temporary file and rename it, so that a concurrent start never maps a partial cache
+	std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+	FILE *f				 = fopen(tmp_path.c_str(), "wb");
+	if (f == nullptr) {
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, f);
+	fwrite(snapshot.data(), 1, snapshot.size(), f);
+
+	bool ok = !ferror(f);
+	ok		= (fclose(f) == 0) && ok;
+	if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+		remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool load_vocab_cache(const std::string &path, const std::string &gguf_path, llama_vocab &vocab) {
+	size_t size;
+	const char *data = map_file(path, size);
+	if (data == nullptr) {
+		return false;
+	}
+
+	VocabCacheHeader header = {};
+	uint64_t meta_hash		= 0;
+	if (size >= sizeof(header)) {
+		memcpy(&header, data, sizeof(header));
+	}
+	bool ok = size >= sizeof(header) && header.magic == VOCAB_CACHE_MAGIC &&
+			  header.version == VOCAB_CACHE_VERSION &&
+			  header.snapshot_size == size - sizeof(header) &&
+			  hash_gguf_metadata(gguf_path, header.meta_size, meta_hash) &&
+			  meta_hash == header.meta_hash;
+
+	// a snapshot that fails to load leaves the vocab untouched for llm_load_vocab
+	if (ok) {
+		llama_vocab loaded;
+		ok = llama_vocab_load(loaded, data + sizeof(header), header.snapshot_size);
+		if (ok) {
+			vocab = std::move(loaded);
+		}
+	}
+
+	munmap((void *)data, size);
+	return ok;
+}
+
+} // namespace sep
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "llama-vocab.h"
+#include <cstdint>
+#include <string>
+
+namespace sep {
+
+// Loaded vocab saved next to its GGUF file, so that the next start skips the
+// GGUF parsing and llm_load_vocab.
+// layout: VocabCacheHeader | llama_vocab_save() snapshot (snapshot_size bytes)
+// The cache belongs to the first meta_size bytes of the GGUF file (header,
+// metadata and tensor infos) and is ignored once their hash changes.
+struct VocabCacheHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t meta_size;
+	uint64_t meta_hash;
+	uint64_t snapshot_size;
+};
+
+constexpr uint32_t VOCAB_CACHE_MAGIC   = 0x56434348; // "VCCH"
+constexpr uint32_t VOCAB_CACHE_VERSION = 1;
+
+// returns false if the cache file could not be written
+bool save_vocab_cache(const std::string &path, const std::string &gguf_path, uint64_t meta_size,
+					  const llama_vocab &vocab);
+// returns false if there is no cache at `path` or it does not belong to the GGUF file
+bool load_vocab_cache(const std::string &path, const std::string &gguf_path, llama_vocab &vocab);
+
+} // namespace sep
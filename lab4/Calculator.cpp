@@ -2,6 +2,18 @@
 #include <cassert>
 #include <cmath>
 
+double DistanceCalculator::calculateDistance(double ax, double ay, double bx,
+                                            double by) const {
+    return calculateDistance(TreeNode({ax, ay}), TreeNode({bx, by}));
+}
+
+double DistanceCalculator::verticalDistance(double ax, double ay, double bx,
+                                            double by, int dim) const {
+    TreeNode a({ax, ay});
+    TreeNode b({bx, by});
+    return verticalDistance(a, b, dim);
+}
+
 double
 ManhattanDistanceCalculator::calculateDistance(const TreeNode &nodeA,
                                                const TreeNode &nodeB) const {
@@ -15,6 +27,18 @@ double ManhattanDistanceCalculator::verticalDistance(TreeNode &root,
     return fabs(root.getCoordinates()[dim]-target.getCoordinates()[dim]);
 }
 
+double ManhattanDistanceCalculator::calculateDistance(double ax, double ay,
+                                                     double bx,
+                                                     double by) const {
+    return fabs(ax - bx) + fabs(ay - by);
+}
+
+double ManhattanDistanceCalculator::verticalDistance(double ax, double ay,
+                                                     double bx, double by,
+                                                     int dim) const {
+    return dim == 0 ? fabs(ax - bx) : fabs(ay - by);
+}
+
 double
 EuclideanDistanceCalculator::calculateDistance(const TreeNode &nodeA,
                                                const TreeNode &nodeB) const {
@@ -28,6 +52,18 @@ double EuclideanDistanceCalculator::verticalDistance(TreeNode &root,
     return fabs(  root.getCoordinates()[dim]-target.getCoordinates()[dim]  );
 }
 
+double EuclideanDistanceCalculator::calculateDistance(double ax, double ay,
+                                                     double bx,
+                                                     double by) const {
+    return sqrt(pow(ax - bx, 2) + pow(ay - by, 2));
+}
+
+double EuclideanDistanceCalculator::verticalDistance(double ax, double ay,
+                                                     double bx, double by,
+                                                     int dim) const {
+    return dim == 0 ? fabs(ax - bx) : fabs(ay - by);
+}
+
 double HaversineDistanceCalculator::deg2rad(double deg) const {
     return (deg * M_PI / 180.0);
 }
@@ -60,4 +96,31 @@ double HaversineDistanceCalculator::verticalDistance(TreeNode &root,
     double delta = std::fabs(root[dim] - target[dim]);
     double factor = dim ? 1 : cos(deg2rad(target[1]));
     return deg2rad(delta) * EARTH_RADIUS * factor;
-}
\ No newline at end of file
+}
+
+double HaversineDistanceCalculator::calculateDistance(double ax, double ay,
+                                                     double bx,
+                                                     double by) const {
+    double lat1_rad = this->deg2rad(ay);
+    double lat2_rad = this->deg2rad(by);
+    double lng1_rad = this->deg2rad(ax);
+    double lng2_rad = this->deg2rad(bx);
+
+    double dlat = lat2_rad - lat1_rad;
+    double dlng = lng2_rad - lng1_rad;
+
+    double a = sin(dlat / 2) * sin(dlat / 2) +
+               cos(lat1_rad) * cos(lat2_rad) * sin(dlng / 2) * sin(dlng / 2);
+    double c = 2 * atan2(sqrt(a), sqrt(1 - a));
+
+    return EARTH_RADIUS * c;
+}
+
+double HaversineDistanceCalculator::verticalDistance(double ax, double ay,
+                                                     double bx, double by,
+                                                     int dim) const {
+    assert(dim >= 0 && dim < 2);
+    double delta = dim ? std::fabs(ay - by) : std::fabs(ax - bx);
+    double factor = dim ? 1 : cos(deg2rad(by));
+    return deg2rad(delta) * EARTH_RADIUS * factor;
+}
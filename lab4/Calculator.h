@@ -9,6 +9,12 @@ public:
                                    const TreeNode &nodeB) const = 0;
   virtual double verticalDistance(TreeNode &root, TreeNode &target,
                                   int dim) const = 0;
+  // 直接用坐标(a为查询点，b为树中的点)计算，扁平存储的树不必为每个点构造TreeNode
+  // 默认构造TreeNode调用上面两个，子类可以重写省掉构造
+  virtual double calculateDistance(double ax, double ay, double bx,
+                                   double by) const;
+  virtual double verticalDistance(double ax, double ay, double bx, double by,
+                                  int dim) const;
   virtual ~DistanceCalculator() {}
 };
 
@@ -18,6 +24,10 @@ public:
                            const TreeNode &nodeB) const override;
   double verticalDistance(TreeNode &root, TreeNode &target,
                           int dim) const override;
+  double calculateDistance(double ax, double ay, double bx,
+                           double by) const override;
+  double verticalDistance(double ax, double ay, double bx, double by,
+                          int dim) const override;
 };
 
 class EuclideanDistanceCalculator : public DistanceCalculator {
@@ -26,6 +36,10 @@ public:
                            const TreeNode &nodeB) const override;
   double verticalDistance(TreeNode &root, TreeNode &target,
                           int dim) const override;
+  double calculateDistance(double ax, double ay, double bx,
+                           double by) const override;
+  double verticalDistance(double ax, double ay, double bx, double by,
+                          int dim) const override;
 };
 
 class HaversineDistanceCalculator : public DistanceCalculator {
@@ -38,4 +52,8 @@ public:
                            const TreeNode &nodeB) const override;
   double verticalDistance(TreeNode &root, TreeNode &target,
                           int dim) const override;
+  double calculateDistance(double ax, double ay, double bx,
+                           double by) const override;
+  double verticalDistance(double ax, double ay, double bx, double by,
+                          int dim) const override;
 };
\ No newline at end of file
@@ -1,7 +1,13 @@
 #include "Tree.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
 #include "Calculator.h"
 #include "Comparator.h"
 #include "TreeNode.h"
@@ -20,12 +26,17 @@ struct DimComparator {
     return isLessThan((*a)[dim], (*b)[dim]);
   }
 };
-BinaryDimenTree::BinaryDimenTree(DistanceCalculator *calculator):calculator(calculator),root(nullptr) {}//构造
+BinaryDimenTree::BinaryDimenTree(DistanceCalculator *calculator):calculator(calculator),storage(Storage::NODES),root(nullptr) {}//构造
 BinaryDimenTree::~BinaryDimenTree() {
     clearall(this->root);
     root=nullptr;
+    for (TreeNode* node : returned) delete node;
 }//析构
+void BinaryDimenTree::set_storage(Storage storage) {
+    this->storage = storage;
+}
 void BinaryDimenTree::clearall(TreeNode*node){
+    if(!node)return;//FLAT或空树没有结点
     if(node->left)clearall(node->left);
     if(node->right)clearall(node->right);
     delete node;
@@ -45,69 +56,77 @@ void BinaryDimenTree::clearall(TreeNode*node){
 TreeNode *BinaryDimenTree::find_nearest_node(TreeNode *target) {
     TreeNode*best=nullptr;
     double best_dist=std::numeric_limits<double>::max();
+    if (storage == Storage::FLAT) {
+        size_t index = xs.size();
+        find_nearest_flat((*target)[0], (*target)[1], 0, xs.size(), 0, index, best_dist);
+        if (index == xs.size()) return nullptr;
+        // 只为返回的点构造TreeNode
+        if (!returned[index]) returned[index] = new TreeNode({xs[index], ys[index]});
+        return returned[index];
+    }
     this->find_nearest(this->root,target,calculator,0,best,best_dist);
     return best;
 }
 
 
 
-int partition(std::vector<pair<double,double>>& vec, int low, int high,int dim) {
-    double pivot = dim==0?(vec[high].first):(vec[high].second); // 选择最后一个元素作为基准
-    int i = (low - 1); // 比基准小的元素的索引
+// 建树用的点，id是它在输入中的序号
+struct Point {
+    double x, y;
+    int id;
+};
 
-    for (int j = low; j <= high - 1; j++) {
-        // 如果当前元素小于或等于基准
-        if ((dim==0?(vec[j].first):(vec[j].second)) <= pivot) {
-            i++; // 增加比基准小的元素的索引
-            std::swap(vec[i], vec[j]);
-        }
-    }
-    std::swap(vec[i + 1], vec[high]);
-    return (i + 1);
+// 把[low, high)按dim的中位数原地重排：中位数放到中点mid，左边都不大于它，右边都不小于它，
+// 再对两边换一维递归。排好后每段的中点就是这段子树的根，两种存储都按这个顺序建树
+// nth_element平均O(n)选出中位数，整体O(n log n)，排好序或大量重复的输入也不会退化，也不拷贝子序列
+void OrderByMedian(std::vector<Point>& vec, size_t low, size_t high, int dim) {
+    if (high - low <= 1) return;
+    size_t mid = low + (high - low) / 2;
+    std::nth_element(vec.begin() + low, vec.begin() + mid, vec.begin() + high,
+                     [dim](const Point& a, const Point& b) {
+                         return dim == 0 ? a.x < b.x : a.y < b.y;
+                     });
+    // 递归深度是log n，两边各少一半
+    OrderByMedian(vec, low, mid, (dim + 1) % 2);
+    OrderByMedian(vec, mid + 1, high, (dim + 1) % 2);
 }
 
-
-// 快速排序的主函数
-void quickSort(std::vector<pair<double,double>>& vec, int low, int high,int dim) {
-    if (low < high) {
-        // pi是分区索引，vec[pi]现在在正确的位置
-        int pi = partition(vec, low, high,dim);
-        // 分别递归地对分区前后的元素进行排序
-        quickSort(vec, low, pi - 1,dim);
-        quickSort(vec, pi + 1, high,dim);
-    }
-}
-
-
-void InsertMedianAndDivide(TreeNode*&root,std::vector<pair<double,double>>& vec,int dim) {
-    if (vec.empty()) return;
-    quickSort(vec, 0, vec.size() - 1,dim);//按照dim快排
-    // 插入中位数点
-    int mid = vec.size() / 2;
-    root=new TreeNode({vec[mid].first, vec[mid].second});
-    // 如果只剩一点（已插入），就结束递归
-    if (vec.size() == 1) return;
-
-    // 创建两个子序列
-    std::vector<pair<double,double>> left(vec.begin(), vec.begin() + mid);
-    std::vector<pair<double,double>> right(vec.begin() + mid + 1, vec.end());
-
-    // 递归处理子序列
-    InsertMedianAndDivide(root->left,left,(dim+1)%2);
-    InsertMedianAndDivide(root->right,right,(dim+1)%2);
+// 为排好的[low, high)建TreeNode子树
+TreeNode *InsertMedianAndDivide(const std::vector<Point>& vec, size_t low, size_t high) {
+    if (low >= high) return nullptr;
+    size_t mid = low + (high - low) / 2;
+    TreeNode* root = new TreeNode({vec[mid].x, vec[mid].y});
+    root->left = InsertMedianAndDivide(vec, low, mid);
+    root->right = InsertMedianAndDivide(vec, mid + 1, high);
+    return root;
 }
 
 
 istream &operator>>(istream &in, BinaryDimenTree &tree) {
     int n; // 结点个数
     in >> n;
-    vector<pair<double,double>> points(n);
+    vector<Point> points(n);
     for(int i = 0; i < n; i++) {
         double x, y;
         in >> x >> y;
-        points[i] = make_pair(x, y); // 使用 make_pair 而不是 emplace_back
+        points[i] = Point{x, y, i};
+    }
+    OrderByMedian(points, 0, points.size(), 0);
+    if (tree.storage == BinaryDimenTree::Storage::FLAT) {
+        tree.xs.resize(n);
+        tree.ys.resize(n);
+        tree.ids.resize(n);
+        tree.slots.resize(n);
+        for (int i = 0; i < n; i++) {
+            tree.xs[i] = points[i].x;
+            tree.ys[i] = points[i].y;
+            tree.ids[i] = points[i].id;
+            tree.slots[points[i].id] = i;
+        }
+        tree.returned.assign(n, nullptr);
+    } else {
+        tree.root = InsertMedianAndDivide(points, 0, points.size());
     }
-    InsertMedianAndDivide(tree.root,points,0);
 
     return in;
 }
@@ -139,7 +158,115 @@ void BinaryDimenTree::find_nearest(TreeNode* node,  TreeNode* target,  DistanceC
     TreeNode* good_side = isLessThan(target->getCoordinates()[cd] , node->getCoordinates()[cd] )? node->left : node->right;//先遍历好的那边
     TreeNode* bad_side = isLessThan(target->getCoordinates()[cd] , node->getCoordinates()[cd]) ? node->right : node->left;
     find_nearest(good_side, target, calculator, depth + 1,best,best_dist);
-    if (isGreaterThan(best_dist, calculator->verticalDistance(*target,*node,cd))) {//遍历完好的再剪枝
+    // 距离相等时另一边也可能有坐标更小的同距离点，不能剪掉
+    if (isGreaterThanOrEqual(best_dist, calculator->verticalDistance(*target,*node,cd))) {//遍历完好的再剪枝
         find_nearest(bad_side, target, calculator, depth + 1,best,best_dist);
     }
-}//寻找最近结点，使用时从树根开始，故depth的默认值已设为0
\ No newline at end of file
+}//寻找最近结点，使用时从树根开始，故depth的默认值已设为0
+
+// 和find_nearest一样的查找和比较顺序，子树是下标区间[low, high)，根在中点
+void BinaryDimenTree::find_nearest_flat(double tx, double ty, size_t low, size_t high, int depth, size_t &best, double &best_dist) const {
+    if (low >= high) return;
+    size_t mid = low + (high - low) / 2;
+    int cd = depth % 2;
+    double x = xs[mid], y = ys[mid];
+
+    double dist = calculator->calculateDistance(tx, ty, x, y);
+    // best还是哨兵xs.size()时没有坐标可比，不能读xs[best]
+    if (isLessThan(dist, best_dist) ||
+        (isEqual(dist, best_dist) && best != xs.size() &&
+         (isLessThan(x, xs[best]) || (isEqual(x, xs[best]) && isLessThan(y, ys[best]))))) {
+        best = mid;
+        best_dist = dist;
+    }
+
+    bool go_left = isLessThan(cd == 0 ? tx : ty, cd == 0 ? x : y);//先遍历好的那边
+    if (go_left) {
+        find_nearest_flat(tx, ty, low, mid, depth + 1, best, best_dist);
+    } else {
+        find_nearest_flat(tx, ty, mid + 1, high, depth + 1, best, best_dist);
+    }
+    if (isGreaterThanOrEqual(best_dist, calculator->verticalDistance(tx, ty, x, y, cd))) {
+        if (go_left) {
+            find_nearest_flat(tx, ty, mid + 1, high, depth + 1, best, best_dist);
+        } else {
+            find_nearest_flat(tx, ty, low, mid, depth + 1, best, best_dist);
+        }
+    }
+}
+
+pair<double,double> BinaryDimenTree::point(int id) const {
+    return make_pair(xs[slots[id]], ys[slots[id]]);
+}
+
+// 把16位的v隔一位展开，放到偶数位上
+static uint32_t SpreadBits(uint32_t v) {
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+vector<int> BinaryDimenTree::find_nearest_batch(const vector<pair<double,double>> &queries, int n_threads) const {
+    if (storage != Storage::FLAT) {
+        throw std::logic_error("find_nearest_batch needs the FLAT storage");
+    }
+    size_t n = queries.size();
+    vector<int> result(n, -1);
+    if (n == 0 || xs.empty()) return result;
+
+    // 在查询点的包围盒里把坐标量化成16位，交错成Morton码，按码排序。
+    // NaN和无穷大的查询不参与包围盒，码放在所有有限码之后，排到最后
+    double min_x = std::numeric_limits<double>::max(), max_x = -min_x;
+    double min_y = min_x, max_y = max_x;
+    for (const auto& q : queries) {
+        if (!std::isfinite(q.first) || !std::isfinite(q.second)) continue;
+        min_x = std::min(min_x, q.first);
+        max_x = std::max(max_x, q.first);
+        min_y = std::min(min_y, q.second);
+        max_y = std::max(max_y, q.second);
+    }
+    // 包围盒跨度太大时max - min会溢出成无穷大，scale就是0
+    double scale_x = max_x > min_x ? 65535.0 / (max_x - min_x) : 0.0;
+    double scale_y = max_y > min_y ? 65535.0 / (max_y - min_y) : 0.0;
+    vector<pair<uint64_t, int>> order(n);
+    for (size_t i = 0; i < n; i++) {
+        const auto& q = queries[i];
+        uint64_t code = uint64_t(1) << 32;
+        if (std::isfinite(q.first) && std::isfinite(q.second)) {
+            uint32_t qx = uint32_t(std::min(65535.0, (q.first - min_x) * scale_x));
+            uint32_t qy = uint32_t(std::min(65535.0, (q.second - min_y) * scale_y));
+            code = SpreadBits(qx) | (SpreadBits(qy) << 1);
+        }
+        order[i] = make_pair(code, int(i));
+    }
+    std::sort(order.begin(), order.end());
+
+    // 每次领一块连续的查询，块内的查询在空间上相邻
+    const size_t chunk = 256;
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        size_t begin;
+        while ((begin = next.fetch_add(chunk)) < n) {
+            size_t end = std::min(n, begin + chunk);
+            for (size_t k = begin; k < end; k++) {
+                const auto& q = queries[order[k].second];
+                size_t best = xs.size();
+                double best_dist = std::numeric_limits<double>::max();
+                find_nearest_flat(q.first, q.second, 0, xs.size(), 0, best, best_dist);
+                if (best != xs.size()) result[order[k].second] = ids[best];
+            }
+        }
+    };
+    vector<std::thread> threads;
+    for (int i = 1; i < n_threads; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+    return result;
+}
@@ -2,6 +2,7 @@
 #include <iostream>
 #include <vector>
 #include <limits>
+#include <utility>
 #include "Calculator.h"
 #include "Comparator.h"
 #include "TreeNode.h"
@@ -9,13 +10,27 @@ using namespace std;
 class BinaryDimenTree {
   /* DO NOT CHANGE SIGNATURE */
   friend istream &operator>>(istream &in,BinaryDimenTree &tree);
+public:
+  // NODES：每个点一个TreeNode，用left/right指针连接
+  // FLAT：坐标按结构数组连续存放，不建TreeNode。建树后[low, high)的中点就是这段子树的根，
+  //       左右子树是[low, mid)和[mid + 1, high)，靠下标找孩子，查询时不追指针
+  enum class Storage { NODES, FLAT };
+
 private:
   /* data */
   DistanceCalculator *calculator;
+  Storage storage;
+  vector<double> xs, ys;        // FLAT：按建树后的顺序存放的坐标
+  vector<int> ids;              // FLAT：每个位置上的点在输入中的序号
+  vector<int> slots;            // FLAT：输入中第i个点存放的位置
+  vector<TreeNode *> returned;  // FLAT：find_nearest_node返回过的点，随树一起释放
+  void find_nearest_flat(double tx, double ty, size_t low, size_t high, int depth, size_t &best, double &best_dist) const;
 
 public:
     TreeNode *root;
   /* methods */
+  // 在读入点之前设置，默认NODES
+  void set_storage(Storage storage);
   void clearall(TreeNode* node);
   //void insert(TreeNode*& node, const std::vector<double>& point, int depth = 0);
   void find_nearest(TreeNode* node,  TreeNode* target,  DistanceCalculator* calculator, int depth,TreeNode*&best,double &best_dist);
@@ -23,6 +38,12 @@ public:
   BinaryDimenTree(DistanceCalculator *calculator);
   /* DO NOT CHANGE SIGNATURE */
   TreeNode *find_nearest_node(TreeNode *target);
+  // 批量查询，只用于FLAT：返回每个查询点最近的点在输入中的序号（树为空时是-1），
+  // 结果和逐个调用find_nearest_node相同。查询先按Morton序排好，空间上相邻的查询
+  // 走的是树的同一部分，再按块分给n_threads个线程，查询时树只读
+  vector<int> find_nearest_batch(const vector<pair<double,double>> &queries, int n_threads) const;
+  // FLAT：输入中第id个点的坐标
+  pair<double,double> point(int id) const;
   /* DO NOT CHANGE SIGNATURE */
   ~BinaryDimenTree(); /* DO NOT CHANGE */
 };
@@ -1,43 +1,75 @@
 #include <fstream>
 #include <iostream>
+#include <algorithm>
 #include <cmath>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include "Tree.h"
 
 using namespace std;
 
-bool do_run(ifstream &testcase, DistanceCalculator *calculator) {
-  auto tree = new BinaryDimenTree(calculator);
-  testcase >> *tree;
+/* actual is null when the tree had no point to return */
+bool check(const pair<double, double> &query, const pair<double, double> &answer,
+           const pair<double, double> *actual) {
+  if (actual && answer == *actual) {
+    return true;
+  }
+  cout << "case:" << query.first << " " << query.second << ",";
+  cout << "expect:" << answer.first << " " << answer.second << ",";
+  if (actual) {
+    cout << "actual:" << actual->first << " " << actual->second << endl;
+  } else {
+    cout << "actual:none" << endl;
+  }
+  return false;
+}
+
+bool do_run(ifstream &testcase, DistanceCalculator *calculator,
+            BinaryDimenTree::Storage storage) {
+  BinaryDimenTree tree(calculator);
+  tree.set_storage(storage);
+  testcase >> tree;
 
   int testNum;
   testcase >> testNum;
-  bool res = true;
+  vector<pair<double, double>> queries(testNum), answers(testNum);
+  for (int i = 0; i < testNum; i++) {
+    testcase >> queries[i].first >> queries[i].second;
+    testcase >> answers[i].first >> answers[i].second;
+  }
+
+  /* every tree answers the queries one by one, the flat tree then answers
+     them again in one batch */
   for (int i = 0; i < testNum; i++) {
-    double x, y;
-    double z, w;
-    testcase >> x;
-    testcase >> y;
-    testcase >> z;
-    testcase >> w;
-    auto target = new TreeNode({x, y});
-    auto node = tree->find_nearest_node(target);
-    auto coordinates = node->getCoordinates();
-    auto answer = new TreeNode({z, w});
-    if (answer->getCoordinates() != node->getCoordinates()) {
-      cout << "case:" << x << " " << y << ",";
-      cout << "expect:" << z << " " << w << ",";
-      cout << "actual:" << coordinates[0] << " " << coordinates[1] << endl;
-      res = false;
-      break;
+    TreeNode target({queries[i].first, queries[i].second});
+    auto node = tree.find_nearest_node(&target);
+    pair<double, double> actual;
+    if (node) {
+      actual = make_pair((*node)[0], (*node)[1]);
+    }
+    if (!check(queries[i], answers[i], node ? &actual : nullptr)) {
+      return false;
     }
   }
-  delete tree;
-  return res;
+  if (storage == BinaryDimenTree::Storage::FLAT) {
+    int n_threads = max(1u, thread::hardware_concurrency());
+    vector<int> ids = tree.find_nearest_batch(queries, n_threads);
+    for (int i = 0; i < testNum; i++) {
+      pair<double, double> actual;
+      if (ids[i] >= 0) {
+        actual = tree.point(ids[i]);
+      }
+      if (!check(queries[i], answers[i], ids[i] >= 0 ? &actual : nullptr)) {
+        return false;
+      }
+    }
+  }
+  return true;
 }
 
-void run(string name) {
+void run(string name, BinaryDimenTree::Storage storage) {
   ifstream testcase;
   testcase.open(name);
 
@@ -46,21 +78,22 @@ void run(string name) {
   bool ret = false;
   if (type == "Manhattan") {
     ManhattanDistanceCalculator calc;
-    ret = do_run(testcase, &calc);
+    ret = do_run(testcase, &calc, storage);
   } else if (type == "Euclidean") {
     EuclideanDistanceCalculator calc;
-    ret = do_run(testcase, &calc);
+    ret = do_run(testcase, &calc, storage);
   } else if (type == "Earth") {
     HaversineDistanceCalculator calc;
-    ret = do_run(testcase, &calc);
+    ret = do_run(testcase, &calc, storage);
   } else {
     cout << "Unknown test type!\n" << endl;
     ret = false;
   }
+  string mode = storage == BinaryDimenTree::Storage::FLAT ? " (flat)" : "";
   if (ret) {
-    cout << "pass at " << name << endl;
+    cout << "pass at " << name << mode << endl;
   } else {
-    cout << "Failed at " << name << endl;
+    cout << "Failed at " << name << mode << endl;
   }
   testcase.close();
 }
@@ -68,13 +101,17 @@ void run(string name) {
 int main() {
   /* You can change the testcase path as you like :) */
   /* run_testcase(<test_file_path>); */
-  run("1.txt");
-  run("2.txt");
+  /* every testcase runs against both storage modes of the tree */
+  for (auto storage :
+       {BinaryDimenTree::Storage::NODES, BinaryDimenTree::Storage::FLAT}) {
+    run("1.txt", storage);
+    run("2.txt", storage);
 
-  /* You are supposed to pass all of those ten testcases to get full grade */
-  for (int i = 1; i <= 30; ++i) {
-    string grade_test_file = "tests/c" + to_string(i);
-    run(grade_test_file);
+    /* You are supposed to pass all of those ten testcases to get full grade */
+    for (int i = 1; i <= 30; ++i) {
+      string grade_test_file = "tests/c" + to_string(i);
+      run(grade_test_file, storage);
+    }
   }
 
   return 0;